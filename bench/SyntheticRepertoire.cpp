@@ -0,0 +1,158 @@
+#include "SyntheticRepertoire.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+namespace {
+
+struct Segment {
+    const char* gene;
+    const char* motif;
+    double weight;
+};
+
+// V genes with the start of the junction they encode and a rough usage weight.
+const Segment V_GENES[] = {
+    { "TRBV20-1", "CSAR", 12 }, { "TRBV5-1", "CASS", 8 },  { "TRBV7-9", "CASS", 8 },
+    { "TRBV28", "CASS", 6 },    { "TRBV6-5", "CASS", 6 },  { "TRBV19", "CASSI", 5 },
+    { "TRBV27", "CASS", 5 },    { "TRBV12-3", "CASS", 5 }, { "TRBV29-1", "CSV", 5 },
+    { "TRBV9", "CASS", 4 },     { "TRBV7-2", "CASS", 4 },  { "TRBV30", "CAW", 3 },
+    { "TRBV4-1", "CASS", 3 },   { "TRBV2", "CASS", 3 },    { "TRBV3-1", "CASS", 3 },
+    { "TRBV11-2", "CASS", 3 },  { "TRBV18", "CASSP", 2 },  { "TRBV10-3", "CAIS", 2 },
+    { "TRBV14", "CASS", 2 },    { "TRBV15", "CATS", 2 },   { "TRBV24-1", "CATS", 2 },
+    { "TRBV6-1", "CASS", 2 },   { "TRBV25-1", "CASS", 2 }, { "TRBV21-1", "CASS", 1 },
+};
+
+// J genes with the end of the junction they encode.
+const Segment J_GENES[] = {
+    { "TRBJ2-7", "YEQYF", 16 },   { "TRBJ2-1", "YNEQFF", 14 },  { "TRBJ2-3", "TDTQYF", 10 },
+    { "TRBJ1-1", "TEAFF", 9 },    { "TRBJ2-5", "QETQYF", 8 },   { "TRBJ1-2", "YGYTF", 8 },
+    { "TRBJ2-2", "NTGELFF", 6 },  { "TRBJ1-5", "NQPQHF", 6 },   { "TRBJ1-4", "TNEKLFF", 5 },
+    { "TRBJ1-6", "SPLHF", 4 },    { "TRBJ2-6", "SGANVLTF", 3 }, { "TRBJ1-3", "SGNTIYF", 3 },
+    { "TRBJ2-4", "AKNIQYF", 2 },
+};
+
+// Junction lengths 8..24 (including the conserved C and F).
+const int MIN_LENGTH = 8;
+const double LENGTH_WEIGHTS[] = { 1, 2, 5, 12, 30, 60, 95, 110, 90, 60, 32, 15, 7, 3, 2, 1, 1 };
+
+// Residues of the N region, where G and S dominate.
+const char N_RESIDUES[] = "GSLTADEQRPNYVKIFHWMC";
+const double N_WEIGHTS[] = { 14, 10, 8, 7, 7, 6, 6, 6, 6, 5, 4, 4, 4, 2, 2, 2, 1, 1, 1, 0.5 };
+
+const char AMINO_ACIDS[] = "ACDEFGHIKLMNPQRSTVWY";
+
+// Rows that repeat an earlier junction.
+const double DUPLICATE_FRACTION = 0.1;
+
+// Draws from the engine directly rather than through the <random>
+// distributions, whose output differs between standard libraries.
+class Sampler {
+public:
+    explicit Sampler(uint64_t seed) : engine_(seed) {}
+
+    double Uniform() { return (engine_() >> 11) * 0x1.0p-53; }
+
+    size_t Below(size_t bound) { return static_cast<size_t>(Uniform() * bound); }
+
+    template <size_t N>
+    size_t Pick(const double (&weights)[N]) {
+        double total = 0;
+        for (double weight : weights) total += weight;
+        double target = Uniform() * total;
+        for (size_t i = 0; i + 1 < N; ++i) {
+            target -= weights[i];
+            if (target < 0) return i;
+        }
+        return N - 1;
+    }
+
+    template <size_t N>
+    const Segment& Pick(const Segment (&segments)[N]) {
+        double weights[N];
+        for (size_t i = 0; i < N; ++i) weights[i] = segments[i].weight;
+        return segments[Pick(weights)];
+    }
+
+private:
+    std::mt19937_64 engine_;
+};
+
+AIRREntity GenerateRecord(Sampler& sampler) {
+    const Segment& v = sampler.Pick(V_GENES);
+    const Segment& j = sampler.Pick(J_GENES);
+    size_t length = MIN_LENGTH + sampler.Pick(LENGTH_WEIGHTS);
+
+    // Exonuclease trimming: sometimes one residue off the V end and up to
+    // three off the J start, never below CA... and ...F plus one residue.
+    std::string prefix(v.motif);
+    std::string suffix(j.motif);
+    if (sampler.Uniform() < 0.25 && prefix.size() > 3) prefix.pop_back();
+    suffix.erase(0, std::min<size_t>(sampler.Below(4), suffix.size() - 2));
+    while (prefix.size() + suffix.size() > length && prefix.size() > 2) prefix.pop_back();
+    while (prefix.size() + suffix.size() > length && suffix.size() > 2) suffix.erase(0, 1);
+
+    std::string junction = prefix;
+    while (junction.size() + suffix.size() < length) {
+        junction += N_RESIDUES[sampler.Pick(N_WEIGHTS)];
+    }
+    junction += suffix;
+    return AIRREntity(junction, v.gene, j.gene, 0);
+}
+
+} // namespace
+
+std::vector<AIRREntity> GenerateRepertoire(size_t size, uint64_t seed) {
+    Sampler sampler(seed);
+    std::vector<AIRREntity> repertoire;
+    repertoire.reserve(size);
+    while (repertoire.size() < size) {
+        if (!repertoire.empty() && sampler.Uniform() < DUPLICATE_FRACTION) {
+            repertoire.push_back(repertoire[sampler.Below(repertoire.size())]);
+        } else {
+            repertoire.push_back(GenerateRecord(sampler));
+        }
+    }
+    return repertoire;
+}
+
+std::vector<std::string> GenerateQueries(const std::vector<AIRREntity>& repertoire, size_t count, uint64_t seed) {
+    Sampler sampler(seed ^ 0x9e3779b97f4a7c15ULL);
+    std::vector<std::string> queries;
+    queries.reserve(count);
+    while (queries.size() < count) {
+        if (repertoire.empty() || sampler.Uniform() < 0.5) {
+            queries.push_back(GenerateRecord(sampler).junctionAA);
+            continue;
+        }
+        std::string query = repertoire[sampler.Below(repertoire.size())].junctionAA;
+        size_t edits = 1 + sampler.Below(2);
+        for (size_t e = 0; e < edits && query.size() > 2; ++e) {
+            // Inside the conserved C and F.
+            size_t position = 1 + sampler.Below(query.size() - 2);
+            char residue = AMINO_ACIDS[sampler.Below(sizeof(AMINO_ACIDS) - 1)];
+            switch (sampler.Below(3)) {
+                case 0: query[position] = residue; break;
+                case 1: query.insert(query.begin() + position, residue); break;
+                default: query.erase(position, 1); break;
+            }
+        }
+        queries.push_back(std::move(query));
+    }
+    return queries;
+}
+
+bool WriteAIRR(const std::vector<AIRREntity>& repertoire, const std::string& path) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to write to " << path << std::endl;
+        return false;
+    }
+    file << "junction_aa\tv_call\tj_call\n";
+    for (const AIRREntity& entity : repertoire) {
+        file << entity.junctionAA << '\t' << entity.vGene << '\t' << entity.jGene << '\n';
+    }
+    return static_cast<bool>(file);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "AirrParser.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Synthetic TRB repertoires for benchmarking. Junctions are assembled from
+// a V-derived prefix (mostly CASS), a random N region with junctional
+// residue bias and a J-derived suffix ending in F, with V/J usage skewed
+// towards the common genes and lengths following the usual CDR3 spectrum.
+// A fraction of the rows repeat an earlier junction, as expanded and public
+// clonotypes do. The same size and seed always give the same repertoire.
+std::vector<AIRREntity> GenerateRepertoire(size_t size, uint64_t seed);
+
+// Queries for a repertoire: half are its junctions with one or two random
+// edits, so that they have neighbours, the rest fresh junctions.
+std::vector<std::string> GenerateQueries(const std::vector<AIRREntity>& repertoire, size_t count, uint64_t seed);
+
+bool WriteAIRR(const std::vector<AIRREntity>& repertoire, const std::string& path);
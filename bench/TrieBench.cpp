@@ -0,0 +1,303 @@
+#include <CLI/CLI.hpp>
+#include "AirrParser.h"
+#include "RadixTrie.h"
+#include "SyntheticRepertoire.h"
+#include "Trie.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+#ifndef TCRTRIE_DEFAULT_MATRIX
+#define TCRTRIE_DEFAULT_MATRIX ""
+#endif
+
+struct BenchConfig {
+    std::vector<size_t> sizes{ 10000, 100000 };
+    size_t queries = 1000;
+    std::vector<int> radii{ 1, 2 };
+    std::vector<float> costRadii{ 2, 4 };
+    // Empty: 1 and hardware_concurrency().
+    std::vector<size_t> threads;
+    uint64_t seed = 42;
+    int repeats = 3;
+    std::string matrixPath = TCRTRIE_DEFAULT_MATRIX;
+    std::string outputPath = "bench.json";
+};
+
+// One measured operation: the fastest and the median of `repeats` runs.
+// items is what one run processes (rows or queries); matches is the size of
+// its result, so that runs doing different work are not compared.
+struct BenchResult {
+    std::string name;
+    size_t size = 0;
+    size_t threads = 1;
+    std::string params;
+    size_t items = 0;
+    size_t matches = 0;
+    double minMs = 0;
+    double medianMs = 0;
+};
+
+// Size of one trie layout built from a repertoire of `size` rows.
+struct StructureResult {
+    std::string name;
+    size_t size = 0;
+    size_t nodes = 0;
+    size_t bytes = 0;
+};
+
+class BenchRunner {
+public:
+    explicit BenchRunner(const BenchConfig& config) : config_(config) {}
+
+    // run() returns the result size of one run.
+    template <typename Run>
+    void Measure(const std::string& name, size_t size, size_t threads, const std::string& params, size_t items,
+                 Run run) {
+        std::vector<double> times;
+        BenchResult result{ name, size, threads, params, items };
+        for (int r = 0; r < std::max(config_.repeats, 1); ++r) {
+            auto start = std::chrono::steady_clock::now();
+            result.matches = run();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            times.push_back(elapsed.count());
+        }
+        std::sort(times.begin(), times.end());
+        result.minMs = times.front();
+        result.medianMs = times[times.size() / 2];
+        std::cerr << name << " size=" << size << " threads=" << threads << (params.empty() ? "" : " ") << params
+                  << ": " << result.medianMs << " ms" << std::endl;
+        results_.push_back(std::move(result));
+    }
+
+    void Record(const std::string& name, size_t size, size_t nodes, size_t bytes) {
+        std::cerr << name << " size=" << size << ": " << nodes << " nodes, " << bytes << " bytes" << std::endl;
+        structures_.push_back({ name, size, nodes, bytes });
+    }
+
+    void WriteJson(std::ostream& out) const;
+
+private:
+    const BenchConfig& config_;
+    std::vector<BenchResult> results_;
+    std::vector<StructureResult> structures_;
+};
+
+void BenchRunner::WriteJson(std::ostream& out) const {
+    out << "{\n"
+        << "  \"seed\": " << config_.seed << ",\n"
+        << "  \"queries\": " << config_.queries << ",\n"
+        << "  \"repeats\": " << config_.repeats << ",\n"
+        << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+        const BenchResult& result = results_[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"name\": \"" << result.name << "\", \"size\": " << result.size
+            << ", \"threads\": " << result.threads << ", \"params\": {" << result.params << "}"
+            << ", \"items\": " << result.items << ", \"matches\": " << result.matches
+            << ", \"min_ms\": " << result.minMs << ", \"median_ms\": " << result.medianMs
+            << ", \"per_item_us\": " << (result.items ? result.minMs * 1000 / result.items : 0) << "}";
+    }
+    out << "\n  ],\n"
+        << "  \"structures\": [";
+    for (size_t i = 0; i < structures_.size(); ++i) {
+        const StructureResult& structure = structures_[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"name\": \"" << structure.name << "\", \"size\": " << structure.size
+            << ", \"nodes\": " << structure.nodes << ", \"bytes\": " << structure.bytes << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+static std::string EditParams(int radius) {
+    std::ostringstream params;
+    params << "\"sub\": " << radius << ", \"ins\": " << radius << ", \"del\": " << radius;
+    return params.str();
+}
+
+static std::string CostParams(float costRadius) {
+    std::ostringstream params;
+    params << "\"cost\": " << costRadius;
+    return params.str();
+}
+
+// The radix search is only worth timing while it finds what the trie finds:
+// the same clonotypes at the same distances, in the same order.
+static void CheckRadixMatches(Trie& trie, const RadixTrie& radix, const std::vector<std::string>& queries,
+                              int radius) {
+    for (const auto& query : queries) {
+        std::vector<Trie::ClonotypeMatch> expected = trie.SearchAIRRClonotypes(query, radius, radius, radius);
+        std::vector<Trie::ClonotypeMatch> found = radix.SearchAIRRClonotypes(query, radius, radius, radius);
+        bool same = expected.size() == found.size();
+        for (size_t i = 0; same && i < expected.size(); ++i) {
+            same = expected[i].clonotype == found[i].clonotype && expected[i].distance == found[i].distance;
+        }
+        if (!same) {
+            throw std::runtime_error("RadixTrie and Trie disagree on " + query + " at radius "
+                                     + std::to_string(radius));
+        }
+    }
+}
+
+static size_t CountMatches(const std::unordered_map<std::string, std::vector<AIRREntity>>& results) {
+    size_t count = 0;
+    for (const auto& [_, matches] : results) {
+        count += matches.size();
+    }
+    return count;
+}
+
+static void BenchSize(BenchRunner& runner, const BenchConfig& config, size_t size) {
+    std::vector<AIRREntity> repertoire = GenerateRepertoire(size, config.seed);
+    std::vector<std::string> queries = GenerateQueries(repertoire, config.queries, config.seed);
+    fs::path airrPath = fs::temp_directory_path()
+                        / ("tcrtrie_bench_" + std::to_string(size) + "_" + std::to_string(config.seed) + ".tsv");
+    if (!WriteAIRR(repertoire, airrPath.string())) {
+        return;
+    }
+
+    runner.Measure("ParseAIRR", size, 1, "", size, [&] { return ParseAIRR(airrPath.string()).size(); });
+    for (size_t threads : config.threads) {
+        ThreadPool pool(threads);
+        runner.Measure("ParseAIRRColumns", size, threads, "", size, [&] {
+            StringColumn junctions, vGenes, jGenes;
+            ParseAIRRColumns(airrPath.string(), pool, junctions, vGenes, jGenes);
+            return junctions.size();
+        });
+    }
+
+    std::vector<std::string> junctions;
+    junctions.reserve(repertoire.size());
+    for (const AIRREntity& entity : repertoire) {
+        junctions.push_back(entity.junctionAA);
+    }
+    runner.Measure("BuildTrie", size, 1, "", size, [&] { return Trie(junctions).ClonotypeCount(); });
+
+    Trie trie(airrPath.string());
+    fs::remove(airrPath);
+    RadixTrie radix(trie);
+    // NodeBytes covers what RadixTrie stores too; the summaries only the Trie has.
+    runner.Record("Trie", size, trie.NodeCount(), trie.NodeBytes());
+    runner.Record("TrieSummaries", size, trie.NodeCount(), trie.SummaryBytes());
+    runner.Record("RadixTrie", size, radix.NodeCount(), radix.MemoryBytes());
+
+    for (int radius : config.radii) {
+        std::string params = EditParams(radius);
+        runner.Measure("SearchAIRR", size, 1, params, queries.size(), [&] {
+            size_t matches = 0;
+            for (const auto& query : queries) {
+                matches += trie.SearchAIRR(query, radius, radius, radius).size();
+            }
+            return matches;
+        });
+        runner.Measure("SearchAIRRClonotypes", size, 1, params, queries.size(), [&] {
+            size_t matches = 0;
+            for (const auto& query : queries) {
+                matches += trie.SearchAIRRClonotypes(query, radius, radius, radius).size();
+            }
+            return matches;
+        });
+        CheckRadixMatches(trie, radix, queries, radius);
+        runner.Measure("RadixSearchAIRRClonotypes", size, 1, params, queries.size(), [&] {
+            size_t matches = 0;
+            for (const auto& query : queries) {
+                matches += radix.SearchAIRRClonotypes(query, radius, radius, radius).size();
+            }
+            return matches;
+        });
+        runner.Measure("Count", size, 1, params, queries.size(), [&] {
+            size_t matches = 0;
+            for (const auto& query : queries) {
+                matches += trie.Count(query, radius, radius, radius);
+            }
+            return matches;
+        });
+        runner.Measure("SearchAny", size, 1, "\"edits\": " + std::to_string(radius), queries.size(), [&] {
+            size_t found = 0;
+            for (const auto& query : queries) {
+                found += trie.SearchAny(query, radius);
+            }
+            return found;
+        });
+        for (size_t threads : config.threads) {
+            trie.SetThreadCount(threads);
+            runner.Measure("SearchForAll", size, threads, params, queries.size(), [&] {
+                return CountMatches(trie.SearchForAll(queries, radius, radius, radius));
+            });
+        }
+    }
+
+    if (config.matrixPath.empty() || !fs::exists(config.matrixPath)) {
+        std::cerr << "No substitution matrix found; skipping matrix searches." << std::endl;
+        return;
+    }
+    trie.LoadSubstitutionMatrix(config.matrixPath);
+    for (float costRadius : config.costRadii) {
+        std::string params = CostParams(costRadius);
+        runner.Measure("SearchWithMatrix", size, 1, params, queries.size(), [&] {
+            size_t matches = 0;
+            for (const auto& query : queries) {
+                matches += trie.SearchWithMatrix(query, costRadius).size();
+            }
+            return matches;
+        });
+        for (size_t threads : config.threads) {
+            trie.SetThreadCount(threads);
+            runner.Measure("SearchForAllWithMatrix", size, threads, params, queries.size(), [&] {
+                return CountMatches(trie.SearchForAllWithMatrix(queries, costRadius));
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    CLI::App app{"TCRtrie benchmarks on synthetic repertoires"};
+
+    BenchConfig config;
+    app.add_option("--sizes", config.sizes, "Repertoire sizes, comma-separated")->delimiter(',');
+    app.add_option("--queries", config.queries, "Queries per search benchmark")->check(CLI::PositiveNumber);
+    app.add_option("--radii", config.radii, "Edit radii for SearchAIRR/SearchAny/SearchForAll (sub = ins = del)")
+            ->delimiter(',');
+    app.add_option("--cost-radii", config.costRadii, "Score radii for the matrix searches")->delimiter(',');
+    app.add_option("--threads", config.threads, "Thread counts for the parallel benchmarks")->delimiter(',');
+    app.add_option("--seed", config.seed, "Seed of the synthetic repertoire and queries");
+    app.add_option("--repeats", config.repeats, "Runs per measurement")->check(CLI::PositiveNumber);
+    app.add_option("-m,--matrix", config.matrixPath, "Substitution matrix for the matrix searches");
+    app.add_option("-o,--output", config.outputPath, "Path of the JSON report");
+
+    CLI11_PARSE(app, argc, argv);
+
+    if (config.threads.empty()) {
+        config.threads.push_back(1);
+        size_t hardwareThreads = std::thread::hardware_concurrency();
+        if (hardwareThreads > 1) config.threads.push_back(hardwareThreads);
+    }
+
+    BenchRunner runner(config);
+    try {
+        for (size_t size : config.sizes) {
+            BenchSize(runner, config, size);
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "Error during benchmark: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(config.outputPath);
+    if (!out.is_open()) {
+        std::cerr << "Error: Unable to write to " << config.outputPath << std::endl;
+        return 1;
+    }
+    runner.WriteJson(out);
+    std::cerr << "Results saved to: " << config.outputPath << std::endl;
+    return 0;
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include "Column.h"
+#include "ThreadPool.h"
+
 #include <string>
 #include <utility>
 #include <vector>
@@ -24,3 +27,9 @@ struct AIRREntity {
 };
 
 std::vector<AIRREntity> ParseAIRR(const std::string& filepath);
+
+// Same rows as ParseAIRR, written straight into packed columns: the file is
+// memory-mapped, split into newline-aligned chunks and the chunks are parsed
+// on `pool`. Rows keep their file order.
+bool ParseAIRRColumns(const std::string& filepath, ThreadPool& pool,
+                      StringColumn& junctionAA, StringColumn& vGenes, StringColumn& jGenes);
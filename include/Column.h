@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Array that either owns its elements or views memory kept alive by someone
+// else (a memory-mapped index file, or the buffer of the column a Snapshot
+// was taken from). Reads never branch on which one it is; the mutators first
+// copy a view into owned storage.
+template <typename T>
+class Column {
+public:
+    Column() = default;
+
+    explicit Column(std::vector<T>&& values) : owned_(std::make_shared<std::vector<T>>(std::move(values))) {
+        Sync();
+    }
+
+    Column(const Column& other) : mapping_(other.mapping_) {
+        if (mapping_) {
+            data_ = other.data_;
+            size_ = other.size_;
+        } else {
+            if (other.owned_) {
+                owned_ = std::make_shared<std::vector<T>>(*other.owned_);
+            }
+            Sync();
+        }
+    }
+
+    Column(Column&& other) noexcept { *this = std::move(other); }
+
+    Column& operator=(const Column& other) {
+        if (this != &other) {
+            Column copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    Column& operator=(Column&& other) noexcept {
+        if (this != &other) {
+            owned_ = std::move(other.owned_);
+            mapping_ = std::move(other.mapping_);
+            if (mapping_) {
+                data_ = other.data_;
+                size_ = other.size_;
+            } else {
+                Sync();
+            }
+            other.owned_.reset();
+            other.Sync();
+        }
+        return *this;
+    }
+
+    // Views `size` elements at `data`; `mapping` keeps the memory alive.
+    void View(std::shared_ptr<const void> mapping, const T* data, size_t size) {
+        owned_.reset();
+        mapping_ = std::move(mapping);
+        data_ = data;
+        size_ = size;
+    }
+
+    // View of the current elements that shares their storage. Growing this
+    // column afterwards never moves or overwrites them: a buffer that is
+    // shared gets replaced instead of reallocated. Mutable on them is the
+    // only way to change what the snapshot sees.
+    Column Snapshot() const {
+        Column snapshot;
+        if (mapping_) {
+            snapshot.View(mapping_, data_, size_);
+        } else if (owned_) {
+            snapshot.View(owned_, data_, size_);
+        }
+        return snapshot;
+    }
+
+    bool IsView() const { return mapping_ != nullptr; }
+
+    const T* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T& operator[](size_t i) const { return data_[i]; }
+    const T* begin() const { return data_; }
+    const T* end() const { return data_ + size_; }
+
+    // Writable element i. Invalidated, like the element pointers, by the
+    // next push_back or append.
+    T& Mutable(size_t i) {
+        Detach();
+        return (*owned_)[i];
+    }
+
+    void push_back(const T& value) {
+        Reserve(size_ + 1, 2 * size_);
+        owned_->push_back(value);
+        Sync();
+    }
+
+    void append(const T* first, const T* last) {
+        Reserve(size_ + (last - first), 2 * size_);
+        owned_->insert(owned_->end(), first, last);
+        Sync();
+    }
+
+    void reserve(size_t capacity) {
+        Reserve(capacity, capacity);
+    }
+
+    void clear() {
+        mapping_.reset();
+        owned_.reset();
+        Sync();
+    }
+
+private:
+    std::shared_ptr<std::vector<T>> owned_;
+    std::shared_ptr<const void> mapping_;
+    const T* data_ = nullptr;
+    size_t size_ = 0;
+
+    void Sync() {
+        data_ = owned_ ? owned_->data() : nullptr;
+        size_ = owned_ ? owned_->size() : 0;
+    }
+
+    void Detach() {
+        if (mapping_) {
+            owned_ = std::make_shared<std::vector<T>>(data_, data_ + size_);
+            mapping_.reset();
+            Sync();
+        } else if (!owned_) {
+            owned_ = std::make_shared<std::vector<T>>();
+        }
+    }
+
+    // Makes room for `needed` elements. A buffer some snapshot still views
+    // is left as it is and replaced by a copy with room for `grown`.
+    void Reserve(size_t needed, size_t grown) {
+        Detach();
+        if (needed <= owned_->capacity()) return;
+        if (owned_.use_count() > 1) {
+            auto replacement = std::make_shared<std::vector<T>>();
+            replacement->reserve(std::max(needed, grown));
+            replacement->assign(owned_->begin(), owned_->end());
+            owned_ = std::move(replacement);
+            Sync();
+        } else {
+            owned_->reserve(std::max(needed, grown));
+        }
+    }
+};
+
+// Column of strings packed back to back: string i is
+// chars[offsets[i], offsets[i + 1]).
+class StringColumn {
+public:
+    StringColumn() { offsets_.push_back(0); }
+
+    explicit StringColumn(const std::vector<std::string>& values) : StringColumn() {
+        for (const auto& value : values) {
+            push_back(value);
+        }
+    }
+
+    // Adopts packed storage: offsets.size() == count + 1 and offsets[0] == 0.
+    StringColumn(std::vector<uint64_t>&& offsets, std::vector<char>&& chars)
+            : offsets_(std::move(offsets)), chars_(std::move(chars)) {}
+
+    std::string_view operator[](size_t i) const {
+        return { chars_.data() + offsets_[i], static_cast<size_t>(offsets_[i + 1] - offsets_[i]) };
+    }
+
+    size_t size() const { return offsets_.size() - 1; }
+    bool empty() const { return size() == 0; }
+
+    void push_back(std::string_view value) {
+        chars_.append(value.data(), value.data() + value.size());
+        offsets_.push_back(chars_.size());
+    }
+
+    void clear() {
+        offsets_.clear();
+        chars_.clear();
+        offsets_.push_back(0);
+    }
+
+    StringColumn Snapshot() const {
+        StringColumn snapshot;
+        snapshot.offsets_ = offsets_.Snapshot();
+        snapshot.chars_ = chars_.Snapshot();
+        return snapshot;
+    }
+
+    const Column<uint64_t>& Offsets() const { return offsets_; }
+    const Column<char>& Chars() const { return chars_; }
+
+    void View(std::shared_ptr<const void> mapping,
+              const uint64_t* offsets, size_t count,
+              const char* chars, size_t charCount) {
+        offsets_.View(mapping, offsets, count + 1);
+        chars_.View(std::move(mapping), chars, charCount);
+    }
+
+private:
+    Column<uint64_t> offsets_;
+    Column<char> chars_;
+};
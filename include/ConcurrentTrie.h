@@ -0,0 +1,93 @@
+#pragma once
+
+#include "Trie.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A Trie that is searched and updated at the same time. Readers pin the
+// current version with Read() and search it without taking a lock; writers
+// apply their updates to a private trie and publish a new version, a
+// Trie::Snapshot sharing the unchanged storage with the previous ones.
+// Versions no reader can still hold are freed by epoch-based reclamation:
+// a reader announces the epoch it started in, and a version retired in
+// epoch e is deleted once every active reader started in e or later.
+// Neither side waits for the other; writers are serialized among
+// themselves.
+class ConcurrentTrie {
+public:
+    explicit ConcurrentTrie(Trie trie);
+    ConcurrentTrie(const ConcurrentTrie&) = delete;
+    ConcurrentTrie& operator=(const ConcurrentTrie&) = delete;
+    // No Reader may outlive the ConcurrentTrie.
+    ~ConcurrentTrie();
+
+    // Keeps one version alive while it exists. Only the search functions
+    // may be called through it (not SelfJoin, which compacts, nor the
+    // update functions).
+    class Reader {
+    public:
+        Reader(Reader&& other) noexcept;
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+        Reader& operator=(Reader&&) = delete;
+        ~Reader();
+
+        Trie& operator*() const { return *trie_; }
+        Trie* operator->() const { return trie_; }
+
+    private:
+        friend class ConcurrentTrie;
+        Reader(std::atomic<uint64_t>* slot, Trie* trie) : slot_(slot), trie_(trie) {}
+
+        std::atomic<uint64_t>* slot_;
+        Trie* trie_;
+    };
+
+    Reader Read();
+
+    void Insert(const std::vector<AIRREntity>& entities);
+
+    size_t Erase(const std::vector<AIRREntity>& entities);
+
+    void Compact();
+
+    // Runs update(trie) on the writer's trie and publishes the result.
+    template <typename UpdateFn>
+    void Update(UpdateFn&& update) {
+        std::lock_guard<std::mutex> lock(writerMutex_);
+        update(writer_);
+        Publish();
+    }
+
+private:
+    static constexpr uint64_t kIdle = UINT64_MAX;
+    static constexpr size_t kReaderSlots = 128;
+
+    // Epoch a reader started in, or kIdle; one cache line each.
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{ kIdle };
+    };
+
+    struct RetiredVersion {
+        std::unique_ptr<Trie> trie;
+        uint64_t epoch;
+    };
+
+    std::array<ReaderSlot, kReaderSlots> slots_;
+    std::atomic<uint64_t> epoch_{ 0 };
+    std::atomic<Trie*> current_{ nullptr };
+
+    std::mutex writerMutex_;
+    Trie writer_;
+    std::vector<RetiredVersion> retired_;
+
+    // Both with writerMutex_ held.
+    void Publish();
+
+    void Reclaim();
+};
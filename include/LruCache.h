@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bounded least-recently-used map from string keys to shared, immutable
+// values, safe to use from several threads. Keys are spread over shards with
+// their own lock and recency list, so the batch workers rarely wait for each
+// other; each shard evicts its own least recently used entry once it holds
+// its share of the capacity.
+template <typename Value>
+class LruCache {
+public:
+    explicit LruCache(size_t capacity, size_t shardCount = 16) {
+        shardCount = std::max<size_t>(1, std::min(shardCount, capacity));
+        for (size_t i = 0; i < shardCount; ++i) {
+            shards_.push_back(std::make_unique<Shard>());
+            // The first capacity % shardCount shards take one entry more.
+            shards_.back()->capacity = capacity / shardCount + (i < capacity % shardCount ? 1 : 0);
+        }
+    }
+
+    // Null when key is not cached.
+    std::shared_ptr<const Value> Get(std::string_view key) {
+        Shard& shard = ShardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+        hits_.fetch_add(1, std::memory_order_relaxed);
+        return found->second->second;
+    }
+
+    void Put(std::string key, std::shared_ptr<const Value> value) {
+        Shard& shard = ShardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.capacity == 0) return;
+        auto found = shard.index.find(key);
+        if (found != shard.index.end()) {
+            found->second->second = std::move(value);
+            shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+            return;
+        }
+        if (shard.entries.size() == shard.capacity) {
+            shard.index.erase(shard.entries.back().first);
+            shard.entries.pop_back();
+        }
+        shard.entries.emplace_front(std::move(key), std::move(value));
+        shard.index.emplace(shard.entries.front().first, shard.entries.begin());
+    }
+
+    void Clear() {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->index.clear();
+            shard->entries.clear();
+        }
+    }
+
+    size_t Size() const {
+        size_t size = 0;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            size += shard->entries.size();
+        }
+        return size;
+    }
+
+    uint64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+
+    uint64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const Value>>;
+
+    // entries is ordered from most to least recently used; index keys view
+    // the key strings of the list nodes, which never move.
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<Entry> entries;
+        std::unordered_map<std::string_view, typename std::list<Entry>::iterator> index;
+        size_t capacity = 0;
+    };
+
+    Shard& ShardFor(std::string_view key) {
+        return *shards_[std::hash<std::string_view>()(key) % shards_.size()];
+    }
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::atomic<uint64_t> hits_{ 0 };
+    std::atomic<uint64_t> misses_{ 0 };
+};
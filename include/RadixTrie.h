@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Trie.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only path-compressed copy of a Trie. Below the shared prefixes most
+// CDR3 branches are chains of nodes with one child and no clonotype; here
+// each chain is a single edge whose letters sit in one label buffer, so the
+// edit search advances over it row by row without a node hop or a call per
+// letter, still dropping the edge as soon as a row becomes unreachable.
+// Clonotype ids are those of the source Trie, which expands matches into
+// records; later updates to it are not seen.
+class RadixTrie {
+public:
+    // Edge into a node: labels_[labelBegin, labelBegin + labelLength).
+    // Children form a contiguous block in DFS order, ordered by first
+    // letter; clonotypes ending at the node are
+    // terminalIndices_[indicesBegin, indicesEnd).
+    struct RadixNode {
+        uint32_t labelBegin = 0;
+        uint32_t labelLength = 0;
+        uint32_t firstChild = 0;
+        uint32_t childCount = 0;
+        uint32_t indicesBegin = 0;
+        uint32_t indicesEnd = 0;
+        Trie::LengthRange lengths;
+    };
+
+    explicit RadixTrie(const Trie& trie);
+
+    // Same matches, in the same order, as Trie::SearchAIRRClonotypes without
+    // gene filters.
+    std::vector<Trie::ClonotypeMatch> SearchAIRRClonotypes(const std::string& query,
+                                                           int maxSubstitution,
+                                                           int maxInsertion,
+                                                           int maxDeletion) const;
+
+    size_t NodeCount() const { return nodes_.size(); }
+
+    // Bytes of the node pool, labels and terminal array.
+    size_t MemoryBytes() const;
+
+private:
+    struct EditSearch {
+        const std::string& query;
+        Trie::EditBudget budget;
+        int queryLength;
+    };
+
+    void BuildNode(const Trie& trie, uint32_t trieNode, uint32_t nodeIndex);
+
+    void SearchRecursive(const EditSearch& search, uint32_t nodeIndex, int depth, int* currentRow,
+                         std::vector<Trie::ClonotypeMatch>& results) const;
+
+    std::vector<RadixNode> nodes_;
+    std::string labels_;
+    std::vector<uint32_t> terminalIndices_;
+    size_t maxDepth_ = 0;
+};
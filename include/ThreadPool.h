@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of worker threads. Every worker owns a deque of tasks: it
+// takes work from the front of its own deque and, once that is empty, steals
+// from the back of the others, so uneven tasks balance themselves out.
+class ThreadPool {
+public:
+    // threadCount == 0 uses std::thread::hardware_concurrency().
+    explicit ThreadPool(size_t threadCount = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t ThreadCount() const;
+
+    // Splits [0, count) into chunks of at most chunkSize and runs
+    // body(begin, end, worker) for each of them on the pool, where worker is
+    // the index (< ThreadCount()) of the executing thread. Blocks until every
+    // chunk is done and rethrows the first exception thrown by body.
+    void ParallelFor(size_t count, size_t chunkSize,
+                     const std::function<void(size_t, size_t, size_t)>& body);
+
+private:
+    struct Batch;
+
+    struct Task {
+        Batch* batch;
+        size_t begin;
+        size_t end;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable wakeUp_;
+    std::atomic<size_t> queuedTasks_{0};
+    bool stopping_ = false;
+
+    void WorkerLoop(size_t worker);
+
+    bool TryPop(size_t worker, Task& task);
+
+    void RunTask(const Task& task, size_t worker);
+};
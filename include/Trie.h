@@ -1,54 +1,261 @@
 #pragma once
 
 #include "AirrParser.h"
+#include "Column.h"
+#include "LruCache.h"
+#include "ThreadPool.h"
 
+#include <algorithm>
 #include <array>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <limits>
+#include <memory>
 #include <optional>
+#include <string_view>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 class Trie {
 public:
+    // Nodes live in one contiguous pool (nodes_). The children of a node form a
+    // contiguous block starting at firstChild, one slot per bit set in childMask
+    // (bit i stands for letter 'A' + i); blocks are laid out in DFS order.
+    // Clonotypes ending at a node are the range [indicesBegin, indicesEnd)
+    // of terminalIndices_.
     struct TrieNode {
-        std::array<TrieNode*, 30> children{};
-        std::vector<int> indices;
+        uint32_t childMask = 0;
+        uint32_t firstChild = 0;
+        uint32_t indicesBegin = 0;
+        uint32_t indicesEnd = 0;
     };
 
-    struct Stat {
-        int distance;
-        int insertion;
-        int deletion;
-        int substitution;
+    // Summary of the genes carried by the sequences of a node's subtree: gene
+    // id g sets bit g % 64. Exact while there are at most 64 distinct genes,
+    // beyond that it may claim genes the subtree does not have, never the
+    // other way round.
+    struct GeneMasks {
+        uint64_t vGenes = 0;
+        uint64_t jGenes = 0;
+    };
+
+    // Shortest and longest trie key (in letters) ending in a node's subtree.
+    struct LengthRange {
+        uint32_t minLength = UINT32_MAX;
+        uint32_t maxLength = 0;
+    };
+
+    // One input row of a clonotype: its interned V/J genes and its position
+    // among the rows the Trie was built from.
+    struct CloneRecord {
+        uint32_t vGene;
+        uint32_t jGene;
+        uint32_t row;
+    };
+
+    // A matching clonotype (distinct junction_aa). Under a gene filter at
+    // least one of its records passes the filter.
+    struct ClonotypeMatch {
+        uint32_t clonotype;
+        double distance;
+    };
+
+    // One matching record, kept as indices instead of copied strings:
+    // `record` indexes the trie's record list and lies within the records of
+    // `clonotype`. Read it through MatchJunction, MatchVGene, MatchJGene and
+    // MatchRow.
+    struct RecordMatch {
+        uint32_t clonotype;
+        uint32_t record;
+        double distance;
+    };
+
+    // Flat batch result: the matches of queries[i] are
+    // matches[offsets[i], offsets[i + 1]), in the order the per-query
+    // search returns them.
+    struct BatchMatches {
+        std::vector<uint64_t> offsets;
+        std::vector<RecordMatch> matches;
+
+        size_t QueryCount() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+        std::pair<const RecordMatch*, const RecordMatch*> ForQuery(size_t query) const {
+            return { matches.data() + offsets[query], matches.data() + offsets[query + 1] };
+        }
+    };
+
+    // Work done by radius searches (SearchAIRR, SearchWithMatrix and their
+    // clonotype and indexed batch forms) that were given a SearchStats; they
+    // add to it. Searches without one compile the counting out. A node is
+    // visited when its subtree is entered. A child is pruned by its gene or
+    // length summary before its DP row is computed, or by distance when no
+    // cell of that row stays within the limits. Terminal hits are
+    // clonotypes ending within the limits; under a gene filter those without
+    // an admitted record are rejected. Times are wall-clock microseconds for
+    // setup (query checks, filter, first row or profile), traversal and
+    // expansion into records.
+    struct SearchStats {
+        uint64_t nodesVisited = 0;
+        uint64_t dpCells = 0;
+        uint64_t prunedByGenes = 0;
+        uint64_t prunedByLength = 0;
+        uint64_t prunedByDistance = 0;
+        uint64_t terminalHits = 0;
+        uint64_t rejectedByGenes = 0;
+        uint64_t matches = 0;
+        double prepareUs = 0;
+        double traverseUs = 0;
+        double expandUs = 0;
+
+        void Add(const SearchStats& other);
+    };
+
+    // An unordered pair of clonotypes within the SelfJoin limits, first <
+    // second.
+    struct NeighborEdge {
+        uint32_t first;
+        uint32_t second;
+        uint32_t distance;
+    };
+
+    // Symmetric CSR adjacency over clonotype ids: the neighbours of clonotype
+    // c are neighbors[offsets[c], offsets[c + 1]), with matching distances.
+    struct NeighborGraph {
+        std::vector<uint64_t> offsets;
+        std::vector<uint32_t> neighbors;
+        std::vector<uint32_t> distances;
+    };
+
+    // DP kernel behind Search and SearchAny. BitParallel is used for queries
+    // of 1..64 letters; longer queries always fall back to Scalar.
+    enum class LevenshteinKernel {
+        Scalar,
+        BitParallel
     };
 
     explicit Trie(const std::vector<std::string>& sequences);
     explicit Trie(const std::string& dataPath);
+    // Parses and builds on `threadPool`, which the Trie then keeps, instead
+    // of creating its own pool.
+    Trie(const std::string& dataPath, std::shared_ptr<ThreadPool> threadPool);
     Trie();
-    Trie(const Trie& other);
-    Trie& operator=(const Trie& other);
-    Trie(Trie&& other) noexcept;
-    Trie& operator=(Trie&& other) noexcept;
-    ~Trie();
+    Trie(const Trie& other) = default;
+    Trie& operator=(const Trie& other) = default;
+    Trie(Trie&& other) noexcept = default;
+    Trie& operator=(Trie&& other) noexcept = default;
+    ~Trie() = default;
 
     std::vector<std::string> Search(const std::string& query, int maxEdits);
 
     std::unordered_map<std::string, std::vector<std::string>> Search(const std::vector<std::string>& queries,
                                                                      int maxEdits);
 
+    // Sequences reachable from query with at most maxSubstitution
+    // substitutions, maxInsertion inserted and maxDeletion deleted letters.
+    // The reported distance is the fewest total edits among such alignments.
     std::vector<AIRREntity> SearchAIRR(const std::string& query,
                                        int maxSubstitution,
                                        int maxInsertion,
                                        int maxDeletion,
                                        const std::optional<std::string>& vGeneFilter = std::nullopt,
-                                       const std::optional<std::string>& jGeneFilter = std::nullopt);
+                                       const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                       SearchStats* stats = nullptr);
 
     std::vector<AIRREntity> SearchWithMatrix(const std::string& query, float maxCost,
                                              const std::optional<std::string>& vGeneFilter = std::nullopt,
-                                             const std::optional<std::string>& jGeneFilter = std::nullopt);
+                                             const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                             SearchStats* stats = nullptr);
+
+    // Group-level variants of SearchAIRR and SearchWithMatrix: one entry per
+    // matching clonotype instead of one AIRREntity per record.
+    std::vector<ClonotypeMatch> SearchAIRRClonotypes(const std::string& query,
+                                                     int maxSubstitution,
+                                                     int maxInsertion,
+                                                     int maxDeletion,
+                                                     const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                     const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                                     SearchStats* stats = nullptr);
+
+    std::vector<ClonotypeMatch> SearchWithMatrixClonotypes(const std::string& query, float maxCost,
+                                                           const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                           const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                                           SearchStats* stats = nullptr);
+
+    // The k clonotypes closest to query, by Levenshtein distance or by
+    // substitution-matrix cost, sorted by distance. No radius is needed:
+    // the trie is explored best-first and the search stops once no subtree
+    // can beat the k-th match found so far. Ties at the k-th distance are
+    // broken by traversal order.
+    std::vector<ClonotypeMatch> SearchNearestClonotypes(const std::string& query, size_t k,
+                                                        const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                        const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    std::vector<ClonotypeMatch> SearchNearestWithMatrixClonotypes(const std::string& query, size_t k,
+                                                                  const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                                  const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    // Records of the k nearest clonotypes, so possibly more than k entries.
+    std::vector<AIRREntity> SearchNearest(const std::string& query, size_t k,
+                                          const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                          const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    std::vector<AIRREntity> SearchNearestWithMatrix(const std::string& query, size_t k,
+                                                    const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                    const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    // Streaming variants of SearchAIRRClonotypes / SearchWithMatrixClonotypes:
+    // visitor(clonotype, distance) is called for every match as the trie is
+    // traversed, and returns VisitAction::Stop to end the search there.
+    // Nothing is collected, and the visitor is inlined into the traversal.
+    // Returns false if the visitor stopped the search. The visitor runs on
+    // the search's DP scratch and must not start another search itself.
+    enum class VisitAction {
+        Continue,
+        Stop
+    };
+
+    template <typename Visitor>
+    bool VisitAIRR(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                   Visitor&& visitor,
+                   const std::optional<std::string>& vGeneFilter = std::nullopt,
+                   const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    template <typename Visitor>
+    bool VisitWithMatrix(const std::string& query, float maxCost, Visitor&& visitor,
+                         const std::optional<std::string>& vGeneFilter = std::nullopt,
+                         const std::optional<std::string>& jGeneFilter = std::nullopt);
 
     bool SearchAny(const std::string& query, int maxEdits);
 
+    // Number of records SearchAIRR / SearchWithMatrix would return, without
+    // collecting them. Without a gene filter, Count takes a subtree whose keys
+    // are all within the budgets whatever their letters (the subtree's length
+    // range decides) from the per-node record counts in one step.
+    uint64_t Count(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                   const std::optional<std::string>& vGeneFilter = std::nullopt,
+                   const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    uint64_t CountWithMatrix(const std::string& query, float maxCost,
+                             const std::optional<std::string>& vGeneFilter = std::nullopt,
+                             const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    // counts[i] is the count of queries[i].
+    std::vector<uint64_t> CountForAll(const std::vector<std::string>& queries,
+                                      int maxSubstitution,
+                                      int maxInsertion,
+                                      int maxDeletion,
+                                      const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                      const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    std::vector<uint64_t> CountForAllWithMatrix(const std::vector<std::string>& queries,
+                                                float maxCost,
+                                                const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                const std::optional<std::string>& jGeneFilter = std::nullopt);
+
     std::unordered_map<std::string, std::vector<AIRREntity>> SearchForAll(const std::vector<std::string>& queries,
                                                                           int maxSubstitution,
                                                                           int maxInsertion,
@@ -61,60 +268,570 @@ public:
                                                                                     const std::optional<std::string>& vGeneFilter = std::nullopt,
                                                                                     const std::optional<std::string>& jGeneFilter = std::nullopt);
 
+    std::unordered_map<std::string, std::vector<AIRREntity>> SearchNearestForAll(const std::vector<std::string>& queries,
+                                                                                 size_t k,
+                                                                                 const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                                                 const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    std::unordered_map<std::string, std::vector<AIRREntity>> SearchNearestForAllWithMatrix(const std::vector<std::string>& queries,
+                                                                                           size_t k,
+                                                                                           const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                                                           const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    // Same matches as SearchForAll / SearchForAllWithMatrix, laid out per
+    // query position (duplicates included) without building strings or a map.
+    // With stats, (*stats)[i] receives the statistics of queries[i].
+    BatchMatches SearchForAllIndexed(const std::vector<std::string>& queries,
+                                     int maxSubstitution,
+                                     int maxInsertion,
+                                     int maxDeletion,
+                                     const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                     const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                     std::vector<SearchStats>* stats = nullptr);
+
+    BatchMatches SearchForAllWithMatrixIndexed(const std::vector<std::string>& queries,
+                                               float maxCost,
+                                               const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                               const std::optional<std::string>& jGeneFilter = std::nullopt,
+                                               std::vector<SearchStats>* stats = nullptr);
+
+    // Same results as SearchForAll / SearchForAllWithMatrix, computed by
+    // traversing the repertoire trie once against a trie of the queries, so
+    // the DP work along a prefix shared by several queries is done once.
+    std::unordered_map<std::string, std::vector<AIRREntity>> JoinForAll(const std::vector<std::string>& queries,
+                                                                        int maxSubstitution,
+                                                                        int maxInsertion,
+                                                                        int maxDeletion,
+                                                                        const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                                        const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    std::unordered_map<std::string, std::vector<AIRREntity>> JoinForAllWithMatrix(const std::vector<std::string>& queries,
+                                                                                  float maxCost,
+                                                                                  const std::optional<std::string>& vGeneFilter = std::nullopt,
+                                                                                  const std::optional<std::string>& jGeneFilter = std::nullopt);
+
+    // Every unordered pair of distinct clonotypes within maxSubstitution
+    // substitutions and maxIndel insertions and deletions each (the same
+    // distance as SearchAIRR with maxInsertion == maxDeletion), compared on
+    // their trie keys. Each pair is reported once, sorted by (first, second).
+    std::vector<NeighborEdge> SelfJoin(int maxSubstitution, int maxIndel);
+
+    NeighborGraph SelfJoinGraph(int maxSubstitution, int maxIndel);
+
+    static bool SaveNeighborEdges(const std::vector<NeighborEdge>& edges, const std::string& path);
+
+    // Adds one record (junction_aa with its V/J genes) to the live trie
+    // without a rebuild and returns the row it was given, one past the
+    // highest row so far. New genes are appended to the dictionaries.
+    uint32_t Insert(const AIRREntity& entity);
+
+    void Insert(const std::vector<AIRREntity>& entities);
+
+    // Removes one record with this junction_aa and V/J genes, the one with
+    // the lowest row. Returns false if there is none. A clonotype left
+    // without records is dropped from its node and its id retired.
+    bool Erase(const AIRREntity& entity);
+
+    // Returns the number of records removed.
+    size_t Erase(const std::vector<AIRREntity>& entities);
+
+    // Updates leave superseded node blocks, terminal and record ranges and
+    // retired clonotypes behind; Insert and Erase compact once those make up
+    // half of the storage. Compacting rebuilds the trie from the live
+    // records, renumbering clonotypes and records but keeping rows.
+    void Compact();
+
+    // Read-only copy of the current contents that shares their storage
+    // instead of copying it. Later Insert, Erase and Compact calls on this
+    // trie copy what they would modify, so the snapshot stays valid and
+    // unchanged and can be searched from other threads meanwhile.
+    // Clonotype ids of the updated clonotypes change when a snapshot holds
+    // them. See ConcurrentTrie.
+    Trie Snapshot();
+
     void LoadSubstitutionMatrix(const std::string& matrixPath);
 
     void SetDeletionScore(float deletionScore);
 
     void SetMaxQueryLength(int newMaxQueryLength);
 
+    // Writes the trie together with its clonotype, record and gene columns to a
+    // versioned binary index file.
+    bool SaveIndex(const std::string& indexPath) const;
+
+    // Replaces the contents with an index written by SaveIndex. The file is
+    // memory-mapped read-only instead of parsed, so loading is near-instant and
+    // processes opening the same index share its pages.
+    bool LoadIndex(const std::string& indexPath);
+
+    void SetLevenshteinKernel(LevenshteinKernel kernel);
+
+    // Id of a V/J gene in the dictionary built at load time, or nullopt when
+    // no sequence carries it.
+    std::optional<uint32_t> FindVGene(std::string_view name) const;
+
+    std::optional<uint32_t> FindJGene(std::string_view name) const;
+
+    std::string_view VGeneName(uint32_t id) const { return vGeneNames_[id]; }
+
+    std::string_view JGeneName(uint32_t id) const { return jGeneNames_[id]; }
+
+    size_t ClonotypeCount() const { return clonotypes_.size(); }
+
+    std::string_view ClonotypeJunction(uint32_t clonotype) const { return clonotypes_[clonotype]; }
+
+    size_t NodeCount() const { return nodes_.size(); }
+
+    // Bytes of the node pool with its length ranges and of the terminal
+    // array: what RadixTrie::MemoryBytes covers of its own layout.
+    size_t NodeBytes() const {
+        return nodes_.size() * (sizeof(TrieNode) + sizeof(LengthRange)) + terminalIndices_.size() * sizeof(int);
+    }
+
+    // Bytes of the per-node gene masks and record counts, which RadixTrie
+    // does not keep.
+    size_t SummaryBytes() const { return nodes_.size() * (sizeof(GeneMasks) + sizeof(uint32_t)); }
+
+    // Records of a clonotype, ordered by row.
+    std::pair<const CloneRecord*, const CloneRecord*> ClonotypeRecords(uint32_t clonotype) const {
+        const RecordRange& range = recordRanges_[clonotype];
+        return { records_.data() + range.begin, records_.data() + range.end };
+    }
+
+    std::string_view MatchJunction(const RecordMatch& match) const { return clonotypes_[match.clonotype]; }
+
+    std::string_view MatchVGene(const RecordMatch& match) const { return vGeneNames_[records_[match.record].vGene]; }
+
+    std::string_view MatchJGene(const RecordMatch& match) const { return jGeneNames_[records_[match.record].jGene]; }
+
+    // Position of the match among the rows the Trie was built from.
+    uint32_t MatchRow(const RecordMatch& match) const { return records_[match.record].row; }
+
+    // Batch searches run on a persistent work-stealing pool, created with
+    // hardware_concurrency() threads on first use unless one is set here.
+    // Copies of a Trie share its pool.
+    void SetThreadCount(size_t threadCount);
+
+    void SetThreadPool(std::shared_ptr<ThreadPool> threadPool);
+
+    // Keeps the clonotype matches of up to `entries` recent radius and top-k
+    // searches, keyed by query, parameters and gene filters, so that repeating
+    // a search costs a hash lookup; 0 (the default) turns the cache off.
+    // Insert, Erase, Compact, LoadIndex and changes to the matrix, deletion
+    // score or maximum query length invalidate what it holds. Copies and
+    // snapshots of a Trie, and so the readers of a ConcurrentTrie, share the
+    // cache. Searches given a SearchStats bypass it. Not to be called while
+    // searches run.
+    void SetResultCacheSize(size_t entries);
+
+    struct ResultCacheStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        size_t entries = 0;
+    };
+
+    ResultCacheStats GetResultCacheStats() const;
+
 private:
+    // Builds its compressed copy from the node pool.
+    friend class RadixTrie;
+
+    // One DP row of the bit-parallel kernel: bit j - 1 of pv/mv is set when
+    // D[j] - D[j - 1] is +1/-1, D[0] is the node depth and D[queryLength] the score.
+    struct BitRow {
+        uint64_t pv;
+        uint64_t mv;
+        int depth;
+        int score;
+    };
+
+    struct EditBudget {
+        int substitutions;
+        int insertions;
+        int deletions;
+    };
+
+    // Cheapest single deletion (trie letter against a gap) and insertion
+    // (query letter against a gap) of the current matrix query.
+    struct IndelCosts {
+        float deletion;
+        float insertion;
+    };
+
+    // Cell value of the constrained edit searches for states outside the
+    // budgets; large enough to stay above any budget after adding a
+    // substitution.
+    static constexpr int kUnreachable = INT_MAX / 2;
+
+    static constexpr uint32_t kAnyGene = UINT32_MAX;
+
+    struct RecordRange {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    // V/J filter resolved to gene ids; kAnyGene leaves that gene unfiltered.
+    struct GeneFilter {
+        uint32_t vGene = kAnyGene;
+        uint32_t jGene = kAnyGene;
+        GeneMasks required;
+
+        bool Active() const { return vGene != kAnyGene || jGene != kAnyGene; }
+
+        bool Admits(uint32_t v, uint32_t j) const {
+            return (vGene == kAnyGene || vGene == v) && (jGene == kAnyGene || jGene == j);
+        }
+
+        bool MayAdmit(const GeneMasks& subtree) const {
+            return (subtree.vGenes & required.vGenes) == required.vGenes
+                   && (subtree.jGenes & required.jGenes) == required.jGenes;
+        }
+    };
+
     bool useSubstitutionMatrix_ = false;
+    LevenshteinKernel levenshteinKernel_ = LevenshteinKernel::BitParallel;
     int maxQueryLength_ = 32;
+    size_t maxDepth_ = 0;
+
+    // Row given to the next inserted record.
+    uint32_t nextRow_ = 0;
+
+    // False once Insert or Erase has run: node blocks may then sit before
+    // their parent and a subtree's terminals no longer form one run, which
+    // SelfJoin relies on. garbage_ counts the slots they left unreachable.
+    bool compacted_ = true;
+    size_t garbage_ = 0;
+
+    // Node the searches start from. It is 0 after a build and moves when an
+    // update has to copy it.
+    uint32_t root_ = 0;
+
+    // Node, terminal, record and clonotype slots below these counts may be
+    // seen by a snapshot; updates copy them instead of modifying them.
+    uint32_t frozenNodes_ = 0;
+    uint32_t frozenTerminals_ = 0;
+    uint32_t frozenRecords_ = 0;
+    uint32_t frozenClonotypes_ = 0;
     float deletionScore_ = -6;
 
+    // Residue codes: 'A'..'Z' -> 0..25, '-' -> kGapCode. costTable_ is the dense
+    // copy of substitutionMatrix_ used by the searches, one padded row per code.
+    static constexpr int kGapCode = 26;
+    static constexpr int kResidueCodes = 27;
+    static constexpr int kCostTableStride = 32;
+
     std::unordered_map<char, std::unordered_map<char, float>> substitutionMatrix_;
-    TrieNode* root_;
+    alignas(64) std::array<float, kResidueCodes * kCostTableStride> costTable_{};
+
+    std::shared_ptr<ThreadPool> threadPool_;
+
+    // Cached results are keyed with the generation of the contents and
+    // scoring they were computed on. Every change takes a generation no trie
+    // has had before, so the results of other versions, including those of
+    // snapshots sharing the cache, never match and age out of it.
+    using ResultCache = LruCache<std::vector<ClonotypeMatch>>;
+    std::shared_ptr<ResultCache> resultCache_;
+    uint64_t resultGeneration_ = NewResultGeneration();
 
-    std::vector<std::string> sequences_;
-    std::vector<std::string> vGenes_;
-    std::vector<std::string> jGenes_;
+    Column<TrieNode> nodes_;
+    Column<int> terminalIndices_;
 
-    void DeleteTrie(TrieNode* node);
+    // Each distinct junction_aa is stored once as a clonotype; its records
+    // are records_[recordRanges_[c].begin, recordRanges_[c].end). Record
+    // genes are ids into vGeneNames_ / jGeneNames_.
+    StringColumn clonotypes_;
+    Column<RecordRange> recordRanges_;
+    Column<CloneRecord> records_;
+    StringColumn vGeneNames_;
+    StringColumn jGeneNames_;
 
-    TrieNode* CopyTrie(const TrieNode* node);
+    // geneMasks_[n], lengthRanges_[n] and subtreeRecords_[n] summarise the
+    // subtree of node n; subtreeRecords_ counts its records exactly.
+    Column<GeneMasks> geneMasks_;
+    Column<LengthRange> lengthRanges_;
+    Column<uint32_t> subtreeRecords_;
 
     void UpdateSubstitutionMatrix(float deletionScore);
 
+    void BuildCostTable();
+
+    static int ResidueCode(char c);
+
+    const float* BuildQueryProfile(const std::string& query) const;
+
     void PrintMatrix();
 
     void SearchRecursive(const std::string& query, int maxEdits,
-                         const std::string& currentPrefix, TrieNode* node,
-                         std::vector<int>& prevRow, int queryLength,
+                         uint32_t nodeIndex, int* currentRow, int queryLength,
                          std::vector<std::string>& results);
 
-    void SearchRecursiveAIRR(const std::string& query, int maxEdits,
-                             TrieNode* node, std::vector<int>& prevRow, int queryLength,
-                             std::vector<AIRREntity>& results,
-                             const std::optional<std::string>& vGeneFilter,
-                             const std::optional<std::string>& jGeneFilter);
+    // State of one SearchAIRR / SearchWithMatrix traversal, set up by the
+    // Prepare* functions. rows points at the thread's DP scratch with the
+    // root row filled in.
+    struct EditSearch {
+        EditBudget budget;
+        GeneFilter filter;
+        int queryLength;
+        int* rows;
+    };
+
+    struct CostSearch {
+        const float* profile;
+        IndelCosts indelCosts;
+        float maxCost;
+        GeneFilter filter;
+        int queryLength;
+        float* rows;
+    };
+
+    // False when the search cannot match anything (too long a query,
+    // negative budgets, unknown gene, no matrix).
+    bool PrepareEditSearch(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                           const std::optional<std::string>& vGeneFilter,
+                           const std::optional<std::string>& jGeneFilter,
+                           EditSearch& search);
+
+    bool PrepareCostSearch(const std::string& query, float maxCost,
+                           const std::optional<std::string>& vGeneFilter,
+                           const std::optional<std::string>& jGeneFilter,
+                           CostSearch& search);
+
+    // Counter hooks of the visitor recursions: NoStats compiles to nothing,
+    // StatsCounters adds to a SearchStats.
+    struct NoStats {
+        void Node() {}
+        void Cells(uint64_t) {}
+        void PrunedByGenes() {}
+        void PrunedByLength() {}
+        void PrunedByDistance() {}
+        void Terminal() {}
+        void Rejected() {}
+    };
 
-    void SearchRecursiveCost(const std::string& query, float maxCost,
-                             TrieNode* node, std::vector<float>& prevRow, int queryLength,
-                             std::vector<AIRREntity>& results,
-                             const std::optional<std::string>& vGeneFilter,
-                             const std::optional<std::string>& jGeneFilter);
+    struct StatsCounters {
+        SearchStats& stats;
+
+        void Node() { ++stats.nodesVisited; }
+        void Cells(uint64_t cells) { stats.dpCells += cells; }
+        void PrunedByGenes() { ++stats.prunedByGenes; }
+        void PrunedByLength() { ++stats.prunedByLength; }
+        void PrunedByDistance() { ++stats.prunedByDistance; }
+        void Terminal() { ++stats.terminalHits; }
+        void Rejected() { ++stats.rejectedByGenes; }
+    };
+
+    // Visitor recursions, see TrieVisit.h. They return false once the
+    // visitor has asked to stop.
+    template <typename Visitor, typename Counters>
+    bool VisitRecursiveAIRR(const std::string& query, const EditSearch& search,
+                            uint32_t nodeIndex, int depth, int* currentRow, Visitor& visitor, Counters& counters);
+
+    template <typename Visitor, typename Counters>
+    bool VisitRecursiveCost(const CostSearch& search, uint32_t nodeIndex, int depth, float* currentRow,
+                            Visitor& visitor, Counters& counters);
+
+    template <typename Visitor, typename Counters>
+    bool VisitClonotypes(uint32_t nodeIndex, double distance, const GeneFilter& filter, Visitor& visitor,
+                         Counters& counters) const;
 
     bool SearchAnyRecursive(const std::string& query, int maxEdits,
-                            TrieNode* node, std::vector<int>& prevRow, int queryLength);
+                            uint32_t nodeIndex, int* currentRow, int queryLength);
+
+    // Per-thread DP scratch: a stack of `rows` rows of `width` cells each,
+    // where row d belongs to the trie node at depth d of the current path.
+    // The buffer only ever grows, so after the first few queries on a thread
+    // the recursive searches run without touching the heap.
+    template <typename T>
+    static T* ScratchRows(size_t rows, size_t width);
+
+    bool UseBitParallel(int queryLength) const;
+
+    static BitRow InitialBitRow(int queryLength);
+
+    static BitRow AdvanceBitRow(const BitRow& row, uint64_t eq, int queryLength);
 
-    std::vector<Stat> PruneStats(const std::vector<Stat>& stats);
+    static bool BitRowExceeds(const BitRow& row, int queryLength, int maxEdits);
 
-    std::vector<Stat> DetailedLevenshteinAll(
-            const std::string& s,
-            const std::string& t,
-            int maxEdits);
+    void SearchRecursiveBitParallel(const uint64_t* peq, int maxEdits,
+                                    uint32_t nodeIndex, const BitRow& row, int queryLength,
+                                    std::vector<std::string>& results);
+
+    bool SearchAnyRecursiveBitParallel(const uint64_t* peq, int maxEdits,
+                                       uint32_t nodeIndex, const BitRow& row, int queryLength);
+
+    // False when a filter names a gene no sequence carries.
+    bool ResolveGeneFilter(const std::optional<std::string>& vGeneFilter,
+                           const std::optional<std::string>& jGeneFilter,
+                           GeneFilter& filter) const;
+
+    bool SubtreeMayMatch(uint32_t nodeIndex, const GeneFilter& filter) const {
+        return !filter.Active() || filter.MayAdmit(geneMasks_[nodeIndex]);
+    }
+
+    bool AnyRecordAdmitted(uint32_t clonotype, const GeneFilter& filter) const;
+
+    uint64_t AdmittedRecords(uint32_t clonotype, const GeneFilter& filter) const;
+
+    // Count traversal, see TrieCount.cpp.
+    uint64_t CountRecursiveAIRR(const std::string& query, const EditSearch& search,
+                                uint32_t nodeIndex, int depth, int* currentRow) const;
+
+    template <typename CountFn>
+    std::vector<uint64_t> RunCountBatch(const std::vector<std::string>& queries, CountFn count);
+
+    void CollectClonotypes(uint32_t nodeIndex, double distance, const GeneFilter& filter,
+                           std::vector<ClonotypeMatch>& results) const;
+
+    // Expands clonotype matches into one AIRREntity per record passing filter.
+    std::vector<AIRREntity> ExpandRecords(const std::vector<ClonotypeMatch>& matches,
+                                          const GeneFilter& filter) const;
+
+    std::shared_ptr<ThreadPool> Pool();
+
+    static uint64_t NewResultGeneration();
+
+    void InvalidateResults() { resultGeneration_ = NewResultGeneration(); }
+
+    // Cache key of a search of one kind ('e' edit budgets, 'c' cost radius,
+    // 'n' / 'm' top-k) with its numeric parameters. Empty without a cache,
+    // which FindResult and StoreResult then ignore.
+    std::string ResultKey(char kind, std::initializer_list<double> params, const std::string& query,
+                          const std::optional<std::string>& vGeneFilter,
+                          const std::optional<std::string>& jGeneFilter) const;
+
+    std::shared_ptr<const std::vector<ClonotypeMatch>> FindResult(const std::string& key) const;
+
+    void StoreResult(std::string key, const std::vector<ClonotypeMatch>& matches) const;
+
+    // Best-first search behind the SearchNearest* functions, see
+    // TrieNearest.cpp.
+    template <typename Value, typename StepFn, typename BoundFn>
+    std::vector<ClonotypeMatch> SearchNearestBestFirst(size_t k, int queryLength, const Value* firstRow,
+                                                       const GeneFilter& filter, StepFn step, BoundFn bound);
+
+    // Trie-vs-trie join, see TrieJoin.cpp.
+    struct EditJoinKernel;
+    struct CostJoinKernel;
+    struct JoinMatchSink;
+    struct SelfJoinSink;
+
+    template <typename Kernel, typename Sink>
+    struct JoinTraversal;
+
+    template <typename Kernel, typename SearchFn>
+    std::unordered_map<std::string, std::vector<AIRREntity>> RunJoin(const std::vector<std::string>& queries,
+                                                                     const Kernel& kernel, const GeneFilter& filter,
+                                                                     SearchFn searchOne);
+
+    // Like ExpandRecords, but appends index-based matches.
+    void AppendRecordMatches(const std::vector<ClonotypeMatch>& matches, const GeneFilter& filter,
+                             std::vector<RecordMatch>& results) const;
+
+    // search(query, stats) returns the clonotype matches of one query;
+    // stats is null unless per-query statistics were asked for.
+    template <typename SearchFn>
+    BatchMatches RunIndexedBatch(const std::vector<std::string>& queries, const GeneFilter& filter,
+                                 SearchFn search, std::vector<SearchStats>* stats);
+
+    // Positions of the first occurrence of each distinct query; first[i] is
+    // that of queries[i]. The batch searches run each distinct query once.
+    static std::vector<size_t> DistinctQueries(const std::vector<std::string>& queries, std::vector<size_t>& first);
+
+    template <typename Result, typename SearchFn>
+    std::unordered_map<std::string, Result> RunBatch(const std::vector<std::string>& queries,
+                                                     SearchFn search);
 
     void LoadAIRR(const std::string& dataPath);
 
-    void BuildTrie();
-};
\ No newline at end of file
+    // Groups the rows into clonotypes and builds the trie over them. Row i
+    // is numbered rowIds[i], or i without rowIds.
+    void BuildTrie(const StringColumn& sequences,
+                   const Column<uint32_t>& vGeneIds, const Column<uint32_t>& jGeneIds,
+                   const std::vector<uint32_t>* rowIds = nullptr);
+
+    // Incremental updates, see TrieUpdate.cpp.
+    uint32_t InsertRecord(const AIRREntity& entity);
+
+    bool EraseRecord(const AIRREntity& entity);
+
+    // Node reached by key from the root, UINT32_MAX when absent.
+    uint32_t FindNode(std::string_view key) const;
+
+    // The root, or the child of a writable nodeIndex for letterCode (added
+    // if missing), copied first if a snapshot may see it.
+    uint32_t WritableRoot();
+
+    uint32_t WritableChild(uint32_t nodeIndex, int letterCode);
+
+    // Copies the terminal range of node to the end of terminalIndices_.
+    void RelocateTerminals(TrieNode& node);
+
+    // Gives a clonotype a new id with a copy of its record range and puts
+    // it at terminal position `position`, which must be writable.
+    uint32_t RenewClonotype(uint32_t clonotype, uint32_t position);
+
+    void CompactIfSparse();
+
+    void BuildGeneMasks();
+
+    void BuildLengthRanges();
+
+    void BuildSubtreeRecords();
+
+    // True when some key below node nodeIndex has between minLength and
+    // maxLength letters.
+    bool SubtreeHasLength(uint32_t nodeIndex, int minLength, int maxLength) const {
+        const LengthRange& range = lengthRanges_[nodeIndex];
+        return static_cast<int64_t>(range.minLength) <= maxLength
+               && static_cast<int64_t>(range.maxLength) >= minLength;
+    }
+
+    // Fills row `next` of a child at depth nextDepth, reached with `letter`,
+    // from its parent's row `up` (cells as in the edit-budget searches) and
+    // returns whether any cell is still within the budgets. `lengths` is the
+    // child's LengthRange.
+    static bool AdvanceEditRow(const std::string& query, const EditBudget& budget, const LengthRange& lengths,
+                               int nextDepth, char letter, const int* up, int* next) {
+        const int queryLength = query.size();
+        const int slots = budget.deletions + 1;
+        // Cell (j, d) holds the fewest substitutions of an alignment of the
+        // trie path against query[0, j) with d deletions. Such an alignment
+        // has exactly d + nextDepth - j insertions, so (j, d) is dropped when
+        // that count or the substitutions leave their budget, or when no key
+        // below the child is long enough (or short enough) to be finished
+        // with the insertions and deletions left.
+        bool reachable = false;
+        for (int j = 0; j <= queryLength; ++j) {
+            int* cell = next + j * slots;
+            const int* above = up + j * slots;
+            for (int d = 0; d < slots; ++d) {
+                int insertions = d + nextDepth - j;
+                if (insertions < 0 || insertions > budget.insertions
+                    || static_cast<int64_t>(lengths.minLength) > queryLength + budget.insertions - d
+                    || static_cast<int64_t>(lengths.maxLength) < nextDepth + queryLength - j - budget.deletions + d) {
+                    cell[d] = kUnreachable;
+                    continue;
+                }
+                int best = above[d];
+                if (j > 0) {
+                    best = std::min(best, above[d - slots] + (query[j - 1] == letter ? 0 : 1));
+                    if (d > 0) best = std::min(best, cell[d - slots - 1]);
+                }
+                if (best > budget.substitutions) {
+                    best = kUnreachable;
+                } else {
+                    reachable = true;
+                }
+                cell[d] = best;
+            }
+        }
+        return reachable;
+    }
+
+    void BuildSubtree(const std::vector<std::string_view>& keys,
+                      std::vector<int>& order, size_t begin, size_t end,
+                      size_t depth, uint32_t nodeIndex,
+                      std::vector<TrieNode>& nodes, std::vector<int>& terminalIndices);
+};
+
+#include "TrieVisit.h"
@@ -1,10 +1,15 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 struct SearchConfig {
     std::string inputPath;
+    std::string loadIndexPath;
+    std::string saveIndexPath;
+    std::string selfJoinPath;
     std::string outputPath;
+    std::string statsPath;
     std::string query;
     std::string inputQueries;
     int maxSubstitution = -1;
@@ -12,9 +17,17 @@ struct SearchConfig {
     int maxDeletion = -1;
     std::string matrixPath;
     float costRadius = -1;
+    int topK = 0;
     float deletionScore = -6;
+    // Entries of the trie's result cache; 0 turns it off. Each entry holds
+    // all matches of its query, so the cache is opt-in.
+    size_t resultCacheSize = 0;
     std::string vGene;
     std::string jGene;
+    bool keepOrder = false;
+    bool useJoin = false;
+    // Write counts.tsv (query, number of matches) instead of results.tsv.
+    bool countOnly = false;
 };
 
 void RunSearch(const SearchConfig& config);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// `TCRtrie serve`: keeps one or more tries loaded and answers line-delimited
+// search requests read from stdin or from the clients of a Unix socket.
+// Requests that arrive together are searched as one batch on the thread pool.
+struct ServeConfig {
+    // Each entry is name=path; a bare path is served under its file stem.
+    std::vector<std::string> triePaths;
+    std::vector<std::string> indexPaths;
+    // Empty: serve stdin/stdout.
+    std::string socketPath;
+    std::string matrixPath;
+    float deletionScore = -6;
+    // Entries of each trie's result cache; 0 turns it off.
+    size_t resultCacheSize = 0;
+    size_t maxBatch = 1000;
+    // How long a batch waits for more requests after its first one.
+    int batchWindowUs = 0;
+};
+
+// `TCRtrie load-test`: replays a query file against a server listening on a
+// Unix socket and reports throughput and latency percentiles.
+struct LoadTestConfig {
+    std::string socketPath;
+    std::string inputQueries;
+    std::string index;
+    // Request options, e.g. s=1 or k=10.
+    std::vector<std::string> options;
+    size_t clients = 4;
+    size_t requests = 10000;
+    // Requests each client keeps in flight.
+    size_t pipeline = 8;
+};
+
+void RunServer(const ServeConfig& config);
+
+void RunLoadTest(const LoadTestConfig& config);
@@ -0,0 +1,156 @@
+#pragma once
+
+// Template definitions of the visitor searches declared in Trie.h. They live
+// in a header so that the visitor can be inlined into the traversal.
+
+template <typename Visitor>
+bool Trie::VisitAIRR(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                     Visitor&& visitor,
+                     const std::optional<std::string>& vGeneFilter,
+                     const std::optional<std::string>& jGeneFilter) {
+    EditSearch search;
+    if (!PrepareEditSearch(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter, search)) {
+        return true;
+    }
+    NoStats counters;
+    return VisitRecursiveAIRR(query, search, root_, 0, search.rows, visitor, counters);
+}
+
+template <typename Visitor>
+bool Trie::VisitWithMatrix(const std::string& query, float maxCost, Visitor&& visitor,
+                           const std::optional<std::string>& vGeneFilter,
+                           const std::optional<std::string>& jGeneFilter) {
+    CostSearch search;
+    if (!PrepareCostSearch(query, maxCost, vGeneFilter, jGeneFilter, search)) {
+        return true;
+    }
+    NoStats counters;
+    return VisitRecursiveCost(search, root_, 0, search.rows, visitor, counters);
+}
+
+template <typename Visitor, typename Counters>
+bool Trie::VisitClonotypes(uint32_t nodeIndex, double distance, const GeneFilter& filter, Visitor& visitor,
+                           Counters& counters) const {
+    const TrieNode& node = nodes_[nodeIndex];
+    for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+        uint32_t clonotype = terminalIndices_[k];
+        counters.Terminal();
+        if (filter.Active() && !AnyRecordAdmitted(clonotype, filter)) {
+            counters.Rejected();
+            continue;
+        }
+        if (visitor(clonotype, distance) == VisitAction::Stop) return false;
+    }
+    return true;
+}
+
+template <typename Visitor, typename Counters>
+bool Trie::VisitRecursiveAIRR(const std::string& query, const EditSearch& search,
+                              uint32_t nodeIndex, int depth, int* currentRow, Visitor& visitor, Counters& counters) {
+    const TrieNode& node = nodes_[nodeIndex];
+    counters.Node();
+    const EditBudget& budget = search.budget;
+    const int queryLength = search.queryLength;
+    const int slots = budget.deletions + 1;
+
+    if (node.indicesBegin != node.indicesEnd) {
+        // Fewest total edits among the alignments that respect every budget.
+        const int* last = currentRow + queryLength * slots;
+        int distance = kUnreachable;
+        for (int d = 0; d < slots; ++d) {
+            if (last[d] != kUnreachable) {
+                distance = std::min(distance, last[d] + 2 * d + depth - queryLength);
+            }
+        }
+        if (distance != kUnreachable && !VisitClonotypes(nodeIndex, distance, search.filter, visitor, counters)) {
+            return false;
+        }
+    }
+
+    int* nextRow = currentRow + (queryLength + 1) * slots;
+    const int nextDepth = depth + 1;
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeMayMatch(child, search.filter)) {
+            counters.PrunedByGenes();
+            continue;
+        }
+        if (!SubtreeHasLength(child, queryLength - budget.deletions, queryLength + budget.insertions)) {
+            counters.PrunedByLength();
+            continue;
+        }
+        counters.Cells((queryLength + 1) * slots);
+        char letter = 'A' + __builtin_ctz(mask);
+        if (!AdvanceEditRow(query, budget, lengthRanges_[child], nextDepth, letter, currentRow, nextRow)) {
+            counters.PrunedByDistance();
+            continue;
+        }
+
+        if (!VisitRecursiveAIRR(query, search, child, nextDepth, nextRow, visitor, counters)) return false;
+    }
+    return true;
+}
+
+template <typename Visitor, typename Counters>
+bool Trie::VisitRecursiveCost(const CostSearch& search, uint32_t nodeIndex, int depth, float* currentRow,
+                              Visitor& visitor, Counters& counters) {
+    const TrieNode& node = nodes_[nodeIndex];
+    counters.Node();
+    const int queryLength = search.queryLength;
+
+    if (node.indicesBegin != node.indicesEnd && (currentRow[queryLength] <= search.maxCost)) {
+        if (!VisitClonotypes(nodeIndex, currentRow[queryLength], search.filter, visitor, counters)) return false;
+    }
+
+    const int stride = queryLength + 1;
+    const float* insertionCosts = search.profile + kGapCode * stride;
+    float* nextRow = currentRow + stride;
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeMayMatch(child, search.filter)) {
+            counters.PrunedByGenes();
+            continue;
+        }
+        counters.Cells(stride);
+        // Row 0 of a letter's profile is its deletion cost, rows 1..m its
+        // substitution costs against each query position.
+        const float* letterCosts = search.profile + __builtin_ctz(mask) * stride;
+        float deletionCost = letterCosts[0];
+
+        nextRow[0] = currentRow[0] + deletionCost;
+        for (int j = 1; j <= queryLength; ++j) {
+            nextRow[j] = std::min(currentRow[j] + deletionCost,
+                                  currentRow[j - 1] + letterCosts[j]);
+        }
+        for (int j = 1; j <= queryLength; ++j) {
+            nextRow[j] = std::min(nextRow[j], nextRow[j - 1] + insertionCosts[j]);
+        }
+
+        // Lower bound of the final cost through cell j: the query has
+        // queryLength - j letters left and every key below the child
+        // between minLength - nextDepth and maxLength - nextDepth, so any
+        // difference has to be paid with the cheapest insertions or deletions.
+        const LengthRange& lengths = lengthRanges_[child];
+        const int64_t minRemaining = static_cast<int64_t>(lengths.minLength) - (depth + 1);
+        const int64_t maxRemaining = static_cast<int64_t>(lengths.maxLength) - (depth + 1);
+        float lowerBound = std::numeric_limits<float>::max();
+        for (int j = 0; j <= queryLength; ++j) {
+            int queryLeft = queryLength - j;
+            float gapCost = 0;
+            if (queryLeft < minRemaining) {
+                gapCost = (minRemaining - queryLeft) * search.indelCosts.deletion;
+            } else if (queryLeft > maxRemaining) {
+                gapCost = (queryLeft - maxRemaining) * search.indelCosts.insertion;
+            }
+            lowerBound = std::min(lowerBound, nextRow[j] + gapCost);
+        }
+
+        if (lowerBound > search.maxCost) {
+            counters.PrunedByDistance();
+            continue;
+        }
+
+        if (!VisitRecursiveCost(search, child, depth + 1, nextRow, visitor, counters)) return false;
+    }
+    return true;
+}
@@ -1,8 +1,17 @@
 #include "AirrParser.h"
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string_view>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 std::vector<AIRREntity> ParseAIRR(const std::string& filepath) {
     std::vector<AIRREntity> entries;
 
@@ -70,3 +79,166 @@ std::vector<AIRREntity> ParseAIRR(const std::string& filepath) {
 
     return entries;
 }
+
+static const size_t MIN_CHUNK_BYTES = 1 << 20;
+
+// Offsets and characters of one column of one chunk, offsets starting at 0.
+struct PackedStrings {
+    std::vector<uint64_t> offsets{0};
+    std::vector<char> chars;
+
+    void Append(std::string_view value) {
+        chars.insert(chars.end(), value.begin(), value.end());
+        offsets.push_back(chars.size());
+    }
+};
+
+struct ChunkColumns {
+    PackedStrings junctionAA;
+    PackedStrings vGenes;
+    PackedStrings jGenes;
+};
+
+static void ParseChunk(const char* begin, const char* end,
+                       int junctionCol, int vCol, int jCol, int maxCol, ChunkColumns& out) {
+    while (begin < end) {
+        const char* lineEnd = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+        if (!lineEnd) lineEnd = end;
+        std::string_view line(begin, lineEnd - begin);
+        begin = lineEnd + 1;
+
+        std::string_view junction, v, j;
+        int col = 0;
+        size_t start = 0;
+        while (col <= maxCol && start <= line.size()) {
+            size_t tab = line.find('\t', start);
+            if (tab == std::string_view::npos) tab = line.size();
+
+            std::string_view fv = line.substr(start, tab - start);
+            if (col == junctionCol) {
+                junction = fv;
+                if (junction.empty()) break;
+            }
+            else if (col == vCol) {
+                v = fv;
+            }
+            else if (col == jCol) {
+                j = fv;
+            }
+
+            start = tab + 1;
+            ++col;
+        }
+
+        if (!junction.empty()) {
+            out.junctionAA.Append(junction);
+            out.vGenes.Append(v);
+            out.jGenes.Append(j);
+        }
+    }
+}
+
+// Concatenates the per-chunk columns, copying the chunks in parallel.
+static StringColumn MergeChunks(std::vector<ChunkColumns>& chunks, PackedStrings ChunkColumns::* column,
+                                ThreadPool& pool) {
+    std::vector<uint64_t> rowBase(chunks.size() + 1, 0);
+    std::vector<uint64_t> charBase(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        const PackedStrings& part = chunks[c].*column;
+        rowBase[c + 1] = rowBase[c] + part.offsets.size() - 1;
+        charBase[c + 1] = charBase[c] + part.chars.size();
+    }
+
+    std::vector<uint64_t> offsets(rowBase.back() + 1);
+    std::vector<char> chars(charBase.back());
+    pool.ParallelFor(chunks.size(), 1, [&](size_t begin, size_t end, size_t) {
+        for (size_t c = begin; c < end; ++c) {
+            PackedStrings& part = chunks[c].*column;
+            for (size_t row = 1; row < part.offsets.size(); ++row) {
+                offsets[rowBase[c] + row] = charBase[c] + part.offsets[row];
+            }
+            std::copy(part.chars.begin(), part.chars.end(), chars.begin() + charBase[c]);
+            part = PackedStrings();
+        }
+    });
+    return StringColumn(std::move(offsets), std::move(chars));
+}
+
+bool ParseAIRRColumns(const std::string& filepath, ThreadPool& pool,
+                      StringColumn& junctionAA, StringColumn& vGenes, StringColumn& jGenes) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "[Error] Failed to open " << filepath << '\n';
+        return false;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        std::cerr << "[Error] Empty file.\n";
+        return false;
+    }
+    size_t fileSize = info.st_size;
+    void* address = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        std::cerr << "[Error] Failed to map " << filepath << '\n';
+        return false;
+    }
+    std::unique_ptr<void, std::function<void(void*)>> mapping(address, [fileSize](void* p) {
+        munmap(p, fileSize);
+    });
+    madvise(address, fileSize, MADV_SEQUENTIAL);
+    const char* data = static_cast<const char*>(address);
+    const char* fileEnd = data + fileSize;
+
+    const char* headerEnd = static_cast<const char*>(std::memchr(data, '\n', fileSize));
+    if (!headerEnd) headerEnd = fileEnd;
+    std::string_view header(data, headerEnd - data);
+    std::unordered_map<std::string_view, int> colIdx;
+    {
+        int idx = 0;
+        size_t pos = 0;
+        while (pos <= header.size()) {
+            size_t tab = header.find('\t', pos);
+            if (tab == std::string_view::npos) tab = header.size();
+            colIdx[header.substr(pos, tab - pos)] = idx++;
+            pos = tab + 1;
+        }
+    }
+    auto itJ = colIdx.find("junction_aa");
+    if (itJ == colIdx.end()) {
+        std::cerr << "[Error] No column junction_aa.\n";
+        return false;
+    }
+    int junctionCol = itJ->second;
+    int vCol = colIdx.count("v_call") ? colIdx["v_call"] : -1;
+    int jCol = colIdx.count("j_call") ? colIdx["j_call"] : -1;
+    int maxCol = std::max(junctionCol, std::max(vCol, jCol));
+
+    // Chunk boundaries are moved forward to the next line start, so every
+    // line belongs to exactly one chunk.
+    const char* body = std::min(headerEnd + 1, fileEnd);
+    size_t bodySize = fileEnd - body;
+    size_t chunkBytes = std::max(MIN_CHUNK_BYTES, bodySize / (4 * pool.ThreadCount()) + 1);
+    std::vector<const char*> bounds{body};
+    while (bounds.back() < fileEnd) {
+        const char* next = bounds.back() + std::min(chunkBytes, static_cast<size_t>(fileEnd - bounds.back()));
+        if (next < fileEnd) {
+            const char* newline = static_cast<const char*>(std::memchr(next, '\n', fileEnd - next));
+            next = newline ? newline + 1 : fileEnd;
+        }
+        bounds.push_back(next);
+    }
+
+    std::vector<ChunkColumns> chunks(bounds.size() - 1);
+    pool.ParallelFor(chunks.size(), 1, [&](size_t begin, size_t end, size_t) {
+        for (size_t c = begin; c < end; ++c) {
+            ParseChunk(bounds[c], bounds[c + 1], junctionCol, vCol, jCol, maxCol, chunks[c]);
+        }
+    });
+
+    junctionAA = MergeChunks(chunks, &ChunkColumns::junctionAA, pool);
+    vGenes = MergeChunks(chunks, &ChunkColumns::vGenes, pool);
+    jGenes = MergeChunks(chunks, &ChunkColumns::jGenes, pool);
+    return true;
+}
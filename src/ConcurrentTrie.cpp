@@ -0,0 +1,77 @@
+#include "ConcurrentTrie.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+ConcurrentTrie::ConcurrentTrie(Trie trie) : writer_(std::move(trie)) {
+    current_.store(new Trie(writer_.Snapshot()));
+}
+
+ConcurrentTrie::~ConcurrentTrie() {
+    delete current_.load();
+}
+
+ConcurrentTrie::Reader::Reader(Reader&& other) noexcept : slot_(other.slot_), trie_(other.trie_) {
+    other.slot_ = nullptr;
+    other.trie_ = nullptr;
+}
+
+ConcurrentTrie::Reader::~Reader() {
+    if (slot_) {
+        slot_->store(kIdle);
+    }
+}
+
+ConcurrentTrie::Reader ConcurrentTrie::Read() {
+    // Threads start looking for a free slot at different places so that
+    // they rarely contend for one.
+    static thread_local size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (;;) {
+        for (size_t i = 0; i < kReaderSlots; ++i) {
+            ReaderSlot& slot = slots_[(hint + i) % kReaderSlots];
+            uint64_t expected = kIdle;
+            // An epoch read before the slot is claimed may be out of date,
+            // which only delays reclamation. Once the slot is claimed, the
+            // version loaded below cannot have been retired before it.
+            if (slot.epoch.load(std::memory_order_relaxed) == kIdle
+                && slot.epoch.compare_exchange_strong(expected, epoch_.load())) {
+                hint = (hint + i) % kReaderSlots;
+                return Reader(&slot.epoch, current_.load());
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+void ConcurrentTrie::Insert(const std::vector<AIRREntity>& entities) {
+    Update([&entities](Trie& trie) { trie.Insert(entities); });
+}
+
+size_t ConcurrentTrie::Erase(const std::vector<AIRREntity>& entities) {
+    size_t erased = 0;
+    Update([&](Trie& trie) { erased = trie.Erase(entities); });
+    return erased;
+}
+
+void ConcurrentTrie::Compact() {
+    Update([](Trie& trie) { trie.Compact(); });
+}
+
+void ConcurrentTrie::Publish() {
+    Trie* previous = current_.exchange(new Trie(writer_.Snapshot()));
+    // Readers that see the new epoch also see the new version.
+    uint64_t retiredAt = epoch_.fetch_add(1) + 1;
+    retired_.push_back({ std::unique_ptr<Trie>(previous), retiredAt });
+    Reclaim();
+}
+
+void ConcurrentTrie::Reclaim() {
+    uint64_t oldest = kIdle;
+    for (const ReaderSlot& slot : slots_) {
+        oldest = std::min(oldest, slot.epoch.load());
+    }
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                                  [oldest](const RetiredVersion& version) { return version.epoch <= oldest; }),
+                   retired_.end());
+}
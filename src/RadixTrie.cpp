@@ -0,0 +1,115 @@
+#include "RadixTrie.h"
+
+#include <algorithm>
+
+RadixTrie::RadixTrie(const Trie& trie) : nodes_(1), maxDepth_(trie.maxDepth_) {
+    BuildNode(trie, trie.root_, 0);
+    nodes_.shrink_to_fit();
+    labels_.shrink_to_fit();
+    terminalIndices_.shrink_to_fit();
+}
+
+void RadixTrie::BuildNode(const Trie& trie, uint32_t trieNode, uint32_t nodeIndex) {
+    const Trie::TrieNode& node = trie.nodes_[trieNode];
+    nodes_[nodeIndex].indicesBegin = terminalIndices_.size();
+    for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+        terminalIndices_.push_back(trie.terminalIndices_[k]);
+    }
+    nodes_[nodeIndex].indicesEnd = terminalIndices_.size();
+
+    uint32_t childCount = __builtin_popcount(node.childMask);
+    if (childCount == 0) return;
+    uint32_t firstChild = nodes_.size();
+    nodes_[nodeIndex].firstChild = firstChild;
+    nodes_[nodeIndex].childCount = childCount;
+    nodes_.resize(nodes_.size() + childCount);
+
+    uint32_t child = node.firstChild;
+    uint32_t slot = firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child, ++slot) {
+        // The edge runs down to the first node that ends a key or branches.
+        uint32_t labelBegin = labels_.size();
+        labels_ += static_cast<char>('A' + __builtin_ctz(mask));
+        uint32_t end = child;
+        for (;;) {
+            const Trie::TrieNode& next = trie.nodes_[end];
+            if (next.indicesBegin != next.indicesEnd || __builtin_popcount(next.childMask) != 1) break;
+            labels_ += static_cast<char>('A' + __builtin_ctz(next.childMask));
+            end = next.firstChild;
+        }
+        nodes_[slot].labelBegin = labelBegin;
+        nodes_[slot].labelLength = labels_.size() - labelBegin;
+        nodes_[slot].lengths = trie.lengthRanges_[end];
+        BuildNode(trie, end, slot);
+    }
+}
+
+size_t RadixTrie::MemoryBytes() const {
+    return nodes_.size() * sizeof(RadixNode) + labels_.size() + terminalIndices_.size() * sizeof(uint32_t);
+}
+
+std::vector<Trie::ClonotypeMatch> RadixTrie::SearchAIRRClonotypes(const std::string& query,
+                                                                  int maxSubstitution,
+                                                                  int maxInsertion,
+                                                                  int maxDeletion) const {
+    std::vector<Trie::ClonotypeMatch> results;
+    if (maxSubstitution < 0 || maxInsertion < 0 || maxDeletion < 0) {
+        return results;
+    }
+    EditSearch search{ query, { maxSubstitution, maxInsertion, maxDeletion }, static_cast<int>(query.size()) };
+    int width = (search.queryLength + 1) * (maxDeletion + 1);
+    int* rows = Trie::ScratchRows<int>(maxDepth_ + 1, width);
+    std::fill(rows, rows + width, Trie::kUnreachable);
+    for (int j = 0; j <= std::min(search.queryLength, maxDeletion); ++j) {
+        rows[j * (maxDeletion + 1) + j] = 0;
+    }
+    SearchRecursive(search, 0, 0, rows, results);
+    return results;
+}
+
+void RadixTrie::SearchRecursive(const EditSearch& search, uint32_t nodeIndex, int depth, int* currentRow,
+                                std::vector<Trie::ClonotypeMatch>& results) const {
+    const RadixNode& node = nodes_[nodeIndex];
+    const Trie::EditBudget& budget = search.budget;
+    const int queryLength = search.queryLength;
+    const int slots = budget.deletions + 1;
+    const int width = (queryLength + 1) * slots;
+
+    if (node.indicesBegin != node.indicesEnd) {
+        const int* last = currentRow + queryLength * slots;
+        int distance = Trie::kUnreachable;
+        for (int d = 0; d < slots; ++d) {
+            if (last[d] != Trie::kUnreachable) {
+                distance = std::min(distance, last[d] + 2 * d + depth - queryLength);
+            }
+        }
+        if (distance != Trie::kUnreachable) {
+            for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+                results.push_back({ terminalIndices_[k], static_cast<double>(distance) });
+            }
+        }
+    }
+
+    for (uint32_t child = node.firstChild; child < node.firstChild + node.childCount; ++child) {
+        const RadixNode& edge = nodes_[child];
+        if (static_cast<int64_t>(edge.lengths.minLength) > queryLength + budget.insertions
+            || static_cast<int64_t>(edge.lengths.maxLength) < queryLength - budget.deletions) {
+            continue;
+        }
+
+        // One row per letter of the edge; the edge is dropped at the first
+        // row with no cell left in the budgets.
+        const char* label = labels_.data() + edge.labelBegin;
+        int* row = currentRow;
+        int rowDepth = depth;
+        bool reachable = true;
+        for (uint32_t k = 0; k < edge.labelLength && reachable; ++k) {
+            reachable = Trie::AdvanceEditRow(search.query, budget, edge.lengths, ++rowDepth, label[k],
+                                             row, row + width);
+            row += width;
+        }
+        if (reachable) {
+            SearchRecursive(search, child, rowDepth, row, results);
+        }
+    }
+}
@@ -0,0 +1,122 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <exception>
+
+struct ThreadPool::Batch {
+    const std::function<void(size_t, size_t, size_t)>* body;
+    std::atomic<size_t> remaining{0};
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(size_t threadCount) {
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < threadCount; ++i) {
+        queues_.push_back(std::make_unique<WorkQueue>());
+    }
+    threads_.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i) {
+        threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeUp_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::ThreadCount() const {
+    return threads_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t chunkSize,
+                             const std::function<void(size_t, size_t, size_t)>& body) {
+    if (count == 0) return;
+    chunkSize = std::max<size_t>(1, chunkSize);
+
+    Batch batch;
+    batch.body = &body;
+    size_t chunks = (count + chunkSize - 1) / chunkSize;
+    batch.remaining = chunks;
+
+    // Deal the chunks out round-robin; stealing evens out whatever imbalance
+    // is left once the workers run.
+    size_t workers = queues_.size();
+    for (size_t w = 0; w < workers && w < chunks; ++w) {
+        std::lock_guard<std::mutex> lock(queues_[w]->mutex);
+        for (size_t c = w; c < chunks; c += workers) {
+            size_t begin = c * chunkSize;
+            queues_[w]->tasks.push_back({ &batch, begin, std::min(count, begin + chunkSize) });
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queuedTasks_ += chunks;
+    }
+    wakeUp_.notify_all();
+
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.done.wait(lock, [&batch] { return batch.remaining == 0; });
+    if (batch.error) {
+        std::rethrow_exception(batch.error);
+    }
+}
+
+void ThreadPool::WorkerLoop(size_t worker) {
+    while (true) {
+        Task task;
+        if (TryPop(worker, task)) {
+            RunTask(task, worker);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        wakeUp_.wait(lock, [this] { return stopping_ || queuedTasks_ > 0; });
+        if (stopping_ && queuedTasks_ == 0) return;
+    }
+}
+
+bool ThreadPool::TryPop(size_t worker, Task& task) {
+    size_t workers = queues_.size();
+    for (size_t offset = 0; offset < workers; ++offset) {
+        WorkQueue& queue = *queues_[(worker + offset) % workers];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (offset == 0) {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        --queuedTasks_;
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::RunTask(const Task& task, size_t worker) {
+    Batch& batch = *task.batch;
+    try {
+        (*batch.body)(task.begin, task.end, worker);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        if (!batch.error) {
+            batch.error = std::current_exception();
+        }
+    }
+    // Decrement under the lock: once the waiter sees zero it may destroy the batch.
+    std::lock_guard<std::mutex> lock(batch.mutex);
+    if (--batch.remaining == 0) {
+        batch.done.notify_all();
+    }
+}
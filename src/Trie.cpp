@@ -1,316 +1,340 @@
 #include "Trie.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <cmath>
 #include <cstring>
 #include <fstream>
-#include <future>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <sstream>
 
-Trie::Trie(const std::string& dataPath) {
-    root_ = new TrieNode();
-    LoadAIRR(dataPath);
-    BuildTrie();
+template <typename T>
+T* Trie::ScratchRows(size_t rows, size_t width) {
+    thread_local std::vector<T> buffer;
+    if (buffer.size() < rows * width) {
+        buffer.resize(rows * width);
+    }
+    return buffer.data();
 }
 
-Trie::Trie(const std::vector<std::string>& sequences)
-        : root_(new TrieNode()), sequences_(sequences)
-{
-    BuildTrie();
-}
+// RadixTrie runs the edit-budget DP on the same scratch.
+template int* Trie::ScratchRows<int>(size_t rows, size_t width);
 
-Trie::Trie() : root_(new TrieNode()) {}
+// Cost of aligning a residue the substitution matrix does not define. It is
+// finite (the build uses -ffast-math) but out of reach of any cost radius, so
+// sequences containing such residues never match instead of failing a lookup.
+static constexpr float kMissingCost = 1e30f;
 
-Trie::Trie(const Trie& other)
-        : root_(nullptr),
-          maxQueryLength_(other.maxQueryLength_),
-          useSubstitutionMatrix_(other.useSubstitutionMatrix_),
-          substitutionMatrix_(other.substitutionMatrix_),
-          sequences_(other.sequences_),
-          vGenes_(other.vGenes_),
-          jGenes_(other.jGenes_)
-{
-    root_ = CopyTrie(other.root_);
+using StatsClock = std::chrono::steady_clock;
+
+static double MicrosecondsSince(StatsClock::time_point start) {
+    return std::chrono::duration<double, std::micro>(StatsClock::now() - start).count();
 }
 
-Trie::Trie(Trie&& other) noexcept
-        : root_(other.root_),
-          maxQueryLength_(other.maxQueryLength_),
-          useSubstitutionMatrix_(other.useSubstitutionMatrix_),
-          substitutionMatrix_(std::move(other.substitutionMatrix_)),
-          sequences_(std::move(other.sequences_)),
-          vGenes_(std::move(other.vGenes_)),
-          jGenes_(std::move(other.jGenes_))
-{
-    other.root_ = nullptr;
-}
-
-Trie& Trie::operator=(const Trie& other) {
-    if (this != &other) {
-        DeleteTrie(root_);
-        maxQueryLength_ = other.maxQueryLength_;
-        useSubstitutionMatrix_ = other.useSubstitutionMatrix_;
-        substitutionMatrix_ = other.substitutionMatrix_;
-        sequences_ = other.sequences_;
-        vGenes_ = other.vGenes_;
-        jGenes_ = other.jGenes_;
-        root_ = CopyTrie(other.root_);
-    }
-    return *this;
-}
-
-Trie& Trie::operator=(Trie&& other) noexcept {
-    if (this != &other) {
-        DeleteTrie(root_);
-        root_ = other.root_;
-        maxQueryLength_ = other.maxQueryLength_;
-        useSubstitutionMatrix_ = other.useSubstitutionMatrix_;
-        substitutionMatrix_ = std::move(other.substitutionMatrix_);
-        sequences_ = std::move(other.sequences_);
-        vGenes_ = std::move(other.vGenes_);
-        jGenes_ = std::move(other.jGenes_);
-        other.root_ = nullptr;
-    }
-    return *this;
-}
-
-Trie::~Trie() {
-    DeleteTrie(root_);
-}
-
-std::vector<Trie::Stat> Trie::PruneStats(const std::vector<Trie::Stat>& stats) {
-    std::vector<Trie::Stat> res;
-    for (auto const& st : stats) {
-        bool dominated = false;
-        for (auto it = res.begin(); it != res.end(); ) {
-            auto const& ex = *it;
-            if (ex.distance <= st.distance
-                && ex.insertion <= st.insertion
-                && ex.deletion <= st.deletion
-                && ex.substitution <= st.substitution) {
-                dominated = true;
-                break;
-            }
-            if (st.distance <= ex.distance
-                && st.insertion <= ex.insertion
-                && st.deletion <= ex.deletion
-                && st.substitution <= ex.substitution) {
-                it = res.erase(it);
-            } else {
-                ++it;
-            }
+void Trie::SearchStats::Add(const SearchStats& other) {
+    nodesVisited += other.nodesVisited;
+    dpCells += other.dpCells;
+    prunedByGenes += other.prunedByGenes;
+    prunedByLength += other.prunedByLength;
+    prunedByDistance += other.prunedByDistance;
+    terminalHits += other.terminalHits;
+    rejectedByGenes += other.rejectedByGenes;
+    matches += other.matches;
+    prepareUs += other.prepareUs;
+    traverseUs += other.traverseUs;
+    expandUs += other.expandUs;
+}
+
+// Match masks of the bit-parallel kernel: bit j - 1 of peq[c] is set when
+// query[j - 1] is the letter 'A' + c.
+static std::array<uint64_t, 26> BuildPeq(const std::string& query) {
+    std::array<uint64_t, 26> peq{};
+    for (size_t j = 0; j < query.size(); ++j) {
+        char c = query[j];
+        if (c >= 'A' && c <= 'Z') {
+            peq[c - 'A'] |= uint64_t{1} << j;
         }
-        if (!dominated)
-            res.push_back(st);
     }
-    return res;
+    return peq;
 }
 
-std::vector<Trie::Stat> Trie::DetailedLevenshteinAll(
-        const std::string& s,
-        const std::string& t,
-        int maxEdits
-) {
-    int n = s.size(), m = t.size();
-    std::vector<std::vector<std::vector<Trie::Stat>>> dp(
-            n+1, std::vector<std::vector<Trie::Stat>>(m+1));
+Trie::BitRow Trie::InitialBitRow(int queryLength) {
+    uint64_t queryMask = queryLength == 64 ? ~uint64_t{0} : (uint64_t{1} << queryLength) - 1;
+    return { queryMask, 0, 0, queryLength };
+}
 
-    dp[0][0].push_back({0,0,0,0});
-    for (int i = 1; i <= n; ++i) {
-        dp[i][0].push_back({i, 0, i, 0});
-    }
-    for (int j = 1; j <= m; ++j) {
-        dp[0][j].push_back({j, j, 0, 0});
+// Advances a row by one trie letter with match mask eq (Myers 1999, in
+// Hyyrö's formulation for global edit distance: D[0] grows by one per letter).
+Trie::BitRow Trie::AdvanceBitRow(const BitRow& row, uint64_t eq, int queryLength) {
+    uint64_t highBit = uint64_t{1} << (queryLength - 1);
+    uint64_t xv = eq | row.mv;
+    uint64_t xh = (((eq & row.pv) + row.pv) ^ row.pv) | eq;
+    uint64_t ph = row.mv | ~(xh | row.pv);
+    uint64_t mh = row.pv & xh;
+
+    int score = row.score;
+    if (ph & highBit) {
+        ++score;
+    } else if (mh & highBit) {
+        --score;
     }
 
-    for (int i = 1; i <= n; ++i) {
-        for (int j = 1; j <= m; ++j) {
-            std::vector<Trie::Stat> cand;
-            for (auto const& st : dp[i-1][j]) {
-                Stat ns = st;
-                ns.distance++; ns.deletion++;
-                if (ns.distance <= maxEdits) cand.push_back(ns);
-            }
-            for (auto const& st : dp[i][j-1]) {
-                Stat ns = st;
-                ns.distance++; ns.insertion++;
-                if (ns.distance <= maxEdits) cand.push_back(ns);
-            }
-            int cost = (s[i-1] == t[j-1] ? 0 : 1);
-            for (auto const& st : dp[i-1][j-1]) {
-                Stat ns = st;
-                ns.distance += cost;
-                ns.substitution += cost;
-                if (ns.distance <= maxEdits) cand.push_back(ns);
+    ph = (ph << 1) | 1;
+    mh <<= 1;
+    return { mh | ~(xv | ph), ph & xv, row.depth + 1, score };
+}
+
+// Prefix-sum summary of four vertical deltas: total and minimum prefix.
+struct NibbleDeltas {
+    int8_t sum;
+    int8_t minPrefix;
+};
+
+static constexpr std::array<NibbleDeltas, 256> BuildNibbleTable() {
+    std::array<NibbleDeltas, 256> table{};
+    for (int pv = 0; pv < 16; ++pv) {
+        for (int mv = 0; mv < 16; ++mv) {
+            int sum = 0, minPrefix = 0;
+            for (int bit = 0; bit < 4; ++bit) {
+                sum += ((pv >> bit) & 1) - ((mv >> bit) & 1);
+                minPrefix = std::min(minPrefix, sum);
             }
-            dp[i][j] = PruneStats(cand);
+            table[pv << 4 | mv] = { static_cast<int8_t>(sum), static_cast<int8_t>(minPrefix) };
         }
     }
-    return dp[n][m];
+    return table;
+}
+
+static constexpr std::array<NibbleDeltas, 256> kNibbleTable = BuildNibbleTable();
+
+// True when every cell of the row exceeds maxEdits, i.e. no extension of the
+// current trie path can match. Tries the O(1) bounds D[queryLength] and
+// depth - popcount(mv) first and only then sums the deltas four at a time.
+bool Trie::BitRowExceeds(const BitRow& row, int queryLength, int maxEdits) {
+    if (row.score <= maxEdits || row.depth <= maxEdits) return false;
+
+    uint64_t queryMask = queryLength == 64 ? ~uint64_t{0} : (uint64_t{1} << queryLength) - 1;
+    uint64_t pv = row.pv & queryMask;
+    uint64_t mv = row.mv & queryMask;
+    if (row.depth - __builtin_popcountll(mv) > maxEdits) return true;
+
+    int value = row.depth;
+    for (int shift = 0; shift < queryLength; shift += 4) {
+        const NibbleDeltas& deltas = kNibbleTable[((pv >> shift) & 0xF) << 4 | ((mv >> shift) & 0xF)];
+        if (value + deltas.minPrefix <= maxEdits) return false;
+        value += deltas.sum;
+    }
+    return true;
+}
+
+Trie::Trie(const std::string& dataPath) : nodes_(std::vector<TrieNode>(1)) {
+    LoadAIRR(dataPath);
+}
+
+Trie::Trie(const std::string& dataPath, std::shared_ptr<ThreadPool> threadPool)
+        : threadPool_(std::move(threadPool)), nodes_(std::vector<TrieNode>(1)) {
+    LoadAIRR(dataPath);
+}
+
+Trie::Trie(const std::vector<std::string>& sequences)
+        : nodes_(std::vector<TrieNode>(1)),
+          vGeneNames_(std::vector<std::string>{""}),
+          jGeneNames_(std::vector<std::string>{""})
+{
+    Column<uint32_t> noGenes(std::vector<uint32_t>(sequences.size(), 0));
+    BuildTrie(StringColumn(sequences), noGenes, noGenes);
 }
 
+Trie::Trie()
+        : nodes_(std::vector<TrieNode>(1)),
+          geneMasks_(std::vector<GeneMasks>(1)),
+          lengthRanges_(std::vector<LengthRange>(1)),
+          subtreeRecords_(std::vector<uint32_t>(1)) {}
+
 std::vector<AIRREntity> Trie::SearchAIRR(const std::string& query,
                                          int maxSubstitution,
                                          int maxInsertion,
                                          int maxDeletion,
                                          const std::optional<std::string>& vGeneFilter,
-                                         const std::optional<std::string>& jGeneFilter) {
-    int maxEdits = maxSubstitution + maxInsertion + maxDeletion;
-    std::vector<AIRREntity> results;
-    int queryLength = query.size();
-
-    if (queryLength > maxQueryLength_) {
-        std::cerr << query << " :query length exceeds maximum allowed length(" << maxQueryLength_ << ")" << std::endl;
-        return results;
+                                         const std::optional<std::string>& jGeneFilter,
+                                         SearchStats* stats) {
+    std::vector<ClonotypeMatch> matches = SearchAIRRClonotypes(query, maxSubstitution, maxInsertion, maxDeletion,
+                                                               vGeneFilter, jGeneFilter, stats);
+    StatsClock::time_point start = stats ? StatsClock::now() : StatsClock::time_point();
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    std::vector<AIRREntity> results = ExpandRecords(matches, filter);
+    if (stats) {
+        stats->matches += results.size();
+        stats->expandUs += MicrosecondsSince(start);
     }
+    return results;
+}
 
-    std::vector<int> initialRow(maxQueryLength_ + 1);
-    for (int i = 0; i <= queryLength; ++i) {
-        initialRow[i] = i;
-    }
-
-    SearchRecursiveAIRR(query, maxEdits, root_, initialRow, queryLength, results, vGeneFilter, jGeneFilter);
-    std::vector<AIRREntity> finalResult;
-    for (const auto& candidate : results) {
-        auto allStats = DetailedLevenshteinAll(query, candidate.junctionAA, maxEdits);
-        bool ok = false;
-        for (auto& st : allStats) {
-            if (st.substitution <= maxSubstitution
-                && st.insertion <= maxInsertion
-                && st.deletion <= maxDeletion) {
-                ok = true;
-                break;
-            }
-        }
-        if (ok) {
-            finalResult.push_back(candidate);
+std::vector<Trie::ClonotypeMatch> Trie::SearchAIRRClonotypes(const std::string& query,
+                                                             int maxSubstitution,
+                                                             int maxInsertion,
+                                                             int maxDeletion,
+                                                             const std::optional<std::string>& vGeneFilter,
+                                                             const std::optional<std::string>& jGeneFilter,
+                                                             SearchStats* stats) {
+    std::vector<ClonotypeMatch> results;
+    auto collect = [&results](uint32_t clonotype, double distance) {
+        results.push_back({ clonotype, distance });
+        return VisitAction::Continue;
+    };
+    if (!stats) {
+        std::string key = ResultKey('e', { double(maxSubstitution), double(maxInsertion), double(maxDeletion) },
+                                    query, vGeneFilter, jGeneFilter);
+        if (auto cached = FindResult(key)) {
+            return *cached;
         }
+        VisitAIRR(query, maxSubstitution, maxInsertion, maxDeletion, collect, vGeneFilter, jGeneFilter);
+        StoreResult(std::move(key), results);
+        return results;
     }
 
-    return finalResult;
+    StatsClock::time_point start = StatsClock::now();
+    EditSearch search;
+    bool ready = PrepareEditSearch(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter,
+                                   search);
+    stats->prepareUs += MicrosecondsSince(start);
+    if (ready) {
+        start = StatsClock::now();
+        StatsCounters counters{ *stats };
+        VisitRecursiveAIRR(query, search, root_, 0, search.rows, collect, counters);
+        stats->traverseUs += MicrosecondsSince(start);
+    }
+    return results;
 }
 
-void Trie::SearchRecursiveAIRR(const std::string& query, int maxEdits,
-                               TrieNode* node, std::vector<int>& prevRow, int queryLength,
-                               std::vector<AIRREntity>& results,
-                               const std::optional<std::string>& vGeneFilter,
-                               const std::optional<std::string>& jGeneFilter) {
-    std::vector<int> currentRow(maxQueryLength_ + 1);
-    std::copy(prevRow.begin(), prevRow.begin() + queryLength + 1, currentRow.begin());
+bool Trie::PrepareEditSearch(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                             const std::optional<std::string>& vGeneFilter,
+                             const std::optional<std::string>& jGeneFilter,
+                             EditSearch& search) {
+    int queryLength = query.size();
 
-    if (!node->indices.empty() && currentRow[queryLength] <= maxEdits) {
-        for (int index : node->indices) {
-            bool vMatch = !vGeneFilter || vGenes_[index] == *vGeneFilter;
-            bool jMatch = !jGeneFilter || jGenes_[index] == *jGeneFilter;
-            if (vMatch && jMatch) {
-                results.emplace_back(sequences_[index],
-                                     vGenes_[index],
-                                     jGenes_[index],
-                                     currentRow[queryLength]);
-            }
-        }
+    if (queryLength > maxQueryLength_) {
+        std::cerr << query << " :query length exceeds maximum allowed length(" << maxQueryLength_ << ")" << std::endl;
+        return false;
     }
 
-    int minVal = *std::min_element(currentRow.begin(), currentRow.begin() + queryLength + 1);
-    if (minVal > maxEdits) return;
+    if (maxSubstitution < 0 || maxInsertion < 0 || maxDeletion < 0) {
+        return false;
+    }
 
-    for (int i = 0; i < node->children.size(); ++i) {
-        TrieNode* child = node->children[i];
-        if (child == nullptr) continue;
-        char letter = 'A' + i;
+    if (!ResolveGeneFilter(vGeneFilter, jGeneFilter, search.filter) || !SubtreeMayMatch(root_, search.filter)) {
+        return false;
+    }
 
-        std::vector<int> nextRow(maxQueryLength_ + 1);
-        nextRow[0] = currentRow[0] + 1;
-        for (int j = 1; j <= queryLength; ++j) {
-            int cost = (query[j - 1] == letter) ? 0 : 1;
-            nextRow[j] = std::min({ currentRow[j] + 1,
-                                    nextRow[j - 1] + 1,
-                                    currentRow[j - 1] + cost
-                                  });
-        }
-        SearchRecursiveAIRR(query, maxEdits, child, nextRow, queryLength, results, vGeneFilter, jGeneFilter);
+    search.budget = { maxSubstitution, maxInsertion, maxDeletion };
+    search.queryLength = queryLength;
+    int width = (queryLength + 1) * (maxDeletion + 1);
+    search.rows = ScratchRows<int>(maxDepth_ + 1, width);
+    std::fill(search.rows, search.rows + width, kUnreachable);
+    for (int j = 0; j <= std::min(queryLength, maxDeletion); ++j) {
+        search.rows[j * (maxDeletion + 1) + j] = 0;
     }
+    return true;
 }
 
 std::vector<AIRREntity> Trie::SearchWithMatrix(const std::string& query, float maxCost,
                                                const std::optional<std::string>& vGeneFilter,
-                                               const std::optional<std::string>& jGeneFilter) {
-    std::vector<AIRREntity> results;
-    int queryLength = query.size();
-
-    if (!useSubstitutionMatrix_) {
-        std::cerr << "No substitution matrix is entered, only Levenshtein distance search is available" << std::endl;
-        return results;
+                                               const std::optional<std::string>& jGeneFilter,
+                                               SearchStats* stats) {
+    std::vector<ClonotypeMatch> matches = SearchWithMatrixClonotypes(query, maxCost, vGeneFilter, jGeneFilter, stats);
+    StatsClock::time_point start = stats ? StatsClock::now() : StatsClock::time_point();
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    std::vector<AIRREntity> results = ExpandRecords(matches, filter);
+    if (stats) {
+        stats->matches += results.size();
+        stats->expandUs += MicrosecondsSince(start);
     }
+    return results;
+}
 
-    if (queryLength > maxQueryLength_) {
-        std::cerr << "Query length exceeds maximum allowed length." << std::endl;
+std::vector<Trie::ClonotypeMatch> Trie::SearchWithMatrixClonotypes(const std::string& query, float maxCost,
+                                                                   const std::optional<std::string>& vGeneFilter,
+                                                                   const std::optional<std::string>& jGeneFilter,
+                                                                   SearchStats* stats) {
+    std::vector<ClonotypeMatch> results;
+    auto collect = [&results](uint32_t clonotype, double distance) {
+        results.push_back({ clonotype, distance });
+        return VisitAction::Continue;
+    };
+    if (!stats) {
+        std::string key = ResultKey('c', { maxCost }, query, vGeneFilter, jGeneFilter);
+        if (auto cached = FindResult(key)) {
+            return *cached;
+        }
+        VisitWithMatrix(query, maxCost, collect, vGeneFilter, jGeneFilter);
+        StoreResult(std::move(key), results);
         return results;
     }
 
-    std::vector<float> initialRow(maxQueryLength_ + 1);
-    initialRow[0] = 0;
-    for (int i = 1; i <= queryLength; ++i) {
-        initialRow[i] = initialRow[i-1] + substitutionMatrix_.at('-').at(query[i-1]);
+    StatsClock::time_point start = StatsClock::now();
+    CostSearch search;
+    bool ready = PrepareCostSearch(query, maxCost, vGeneFilter, jGeneFilter, search);
+    stats->prepareUs += MicrosecondsSince(start);
+    if (ready) {
+        start = StatsClock::now();
+        StatsCounters counters{ *stats };
+        VisitRecursiveCost(search, root_, 0, search.rows, collect, counters);
+        stats->traverseUs += MicrosecondsSince(start);
     }
-    SearchRecursiveCost(query, maxCost, root_, initialRow, queryLength,
-                        results, vGeneFilter, jGeneFilter);
-
     return results;
 }
 
-void Trie::SearchRecursiveCost(const std::string& query, float maxCost,
-                               TrieNode* node, std::vector<float>& prevRow, int queryLength,
-                               std::vector<AIRREntity>& results,
-                               const std::optional<std::string>& vGeneFilter,
-                               const std::optional<std::string>& jGeneFilter) {
-    std::vector<float> currentRow(maxQueryLength_ + 1);
-    std::copy(prevRow.begin(), prevRow.begin() + queryLength + 1, currentRow.begin());
-
-
-    if (!node->indices.empty() && (currentRow[queryLength] <= maxCost)) {
-        for (int index : node->indices) {
-            bool vMatch = !vGeneFilter || vGenes_[index] == *vGeneFilter;
-            bool jMatch = !jGeneFilter || jGenes_[index] == *jGeneFilter;
-            if (vMatch && jMatch) {
-                results.emplace_back(sequences_[index],
-                                     vGenes_[index],
-                                     jGenes_[index],
-                                     currentRow[queryLength]);
-            }
-        }
-    }
-
-    for (int i = 0; i < node->children.size(); ++i) {
-        TrieNode* child = node->children[i];
-        if (!child) continue;
-        char letter = 'A' + i;
+bool Trie::PrepareCostSearch(const std::string& query, float maxCost,
+                             const std::optional<std::string>& vGeneFilter,
+                             const std::optional<std::string>& jGeneFilter,
+                             CostSearch& search) {
+    int queryLength = query.size();
 
-        std::vector<float> nextRow(maxQueryLength_ + 1);
-        nextRow[0] = currentRow[0] + substitutionMatrix_.at('-').at(letter);
-        float minVal = nextRow[0];
+    if (!useSubstitutionMatrix_) {
+        std::cerr << "No substitution matrix is entered, only Levenshtein distance search is available" << std::endl;
+        return false;
+    }
 
-        float depletionCost = substitutionMatrix_.at('-').at(letter);
-        for (int j = 1; j <= queryLength; ++j) {
-            char queryChar = query[j - 1];
-            float subCost = substitutionMatrix_.at(queryChar).at(letter);
-            float insertionCost = substitutionMatrix_.at('-').at(queryChar);
+    if (queryLength > maxQueryLength_) {
+        std::cerr << "Query length exceeds maximum allowed length." << std::endl;
+        return false;
+    }
 
-            nextRow[j] = std::min({
-                                          currentRow[j] + depletionCost,
-                                          nextRow[j - 1] + insertionCost,
-                                          currentRow[j - 1] + subCost
-                                  });
-            minVal = std::min(minVal, nextRow[j]);
-        }
+    if (!ResolveGeneFilter(vGeneFilter, jGeneFilter, search.filter) || !SubtreeMayMatch(root_, search.filter)) {
+        return false;
+    }
 
-        if (minVal > maxCost) continue;
+    const float* profile = BuildQueryProfile(query);
+    const float* insertionCosts = profile + kGapCode * (queryLength + 1);
+    float* rows = ScratchRows<float>(maxDepth_ + 1, queryLength + 1);
+    rows[0] = 0;
+    for (int i = 1; i <= queryLength; ++i) {
+        rows[i] = rows[i-1] + insertionCosts[i];
+    }
 
-        SearchRecursiveCost(query, maxCost, child, nextRow, queryLength,
-                            results, vGeneFilter, jGeneFilter);
+    IndelCosts indelCosts{ kMissingCost, kMissingCost };
+    for (int c = 0; c < kGapCode; ++c) {
+        indelCosts.deletion = std::min(indelCosts.deletion, profile[c * (queryLength + 1)]);
+    }
+    for (int j = 1; j <= queryLength; ++j) {
+        indelCosts.insertion = std::min(indelCosts.insertion, insertionCosts[j]);
     }
+    indelCosts.deletion = std::max(indelCosts.deletion, 0.0f);
+    indelCosts.insertion = std::max(indelCosts.insertion, 0.0f);
+
+    search.profile = profile;
+    search.indelCosts = indelCosts;
+    search.maxCost = maxCost;
+    search.queryLength = queryLength;
+    search.rows = rows;
+    return true;
 }
 
 std::vector<std::string> Trie::Search(const std::string& query, int maxEdits) {
@@ -320,37 +344,41 @@ std::vector<std::string> Trie::Search(const std::string& query, int maxEdits) {
         std::cerr << "Query length exceeds maximum allowed length." << std::endl;
         return results;
     }
-    std::vector<int> initialRow(maxQueryLength_ + 1);
+    if (UseBitParallel(queryLength)) {
+        std::array<uint64_t, 26> peq = BuildPeq(query);
+        SearchRecursiveBitParallel(peq.data(), maxEdits, root_, InitialBitRow(queryLength), queryLength, results);
+        return results;
+    }
+    int* rows = ScratchRows<int>(maxDepth_ + 1, queryLength + 1);
     for (int i = 0; i <= queryLength; ++i) {
-        initialRow[i] = i;
+        rows[i] = i;
     }
-    SearchRecursive(query, maxEdits, "", root_, initialRow, queryLength, results);
+    SearchRecursive(query, maxEdits, root_, rows, queryLength, results);
 
     return results;
 }
 
-void Trie::SearchRecursive(const std::string& query, int maxEdits, const std::string& currentPrefix,
-                           TrieNode* node, std::vector<int>& prevRow, int queryLength, std::vector<std::string>& results) {
-    std::vector<int> currentRow(maxQueryLength_ + 1);
-
-    std::copy(prevRow.begin(), prevRow.begin() + queryLength + 1, currentRow.begin());
-    std::string prefix = currentPrefix;
+void Trie::SearchRecursive(const std::string& query, int maxEdits,
+                           uint32_t nodeIndex, int* currentRow, int queryLength, std::vector<std::string>& results) {
+    const TrieNode& node = nodes_[nodeIndex];
 
-    if (!node->indices.empty() && currentRow[queryLength] <= maxEdits) {
-        for (int index : node->indices) {
-            results.push_back(sequences_[index]);
+    if (node.indicesBegin != node.indicesEnd && currentRow[queryLength] <= maxEdits) {
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            uint32_t clonotype = terminalIndices_[k];
+            const RecordRange& range = recordRanges_[clonotype];
+            results.insert(results.end(), range.end - range.begin, std::string(clonotypes_[clonotype]));
         }
     }
 
-    int minVal = *std::min_element(currentRow.begin(), currentRow.begin() + queryLength + 1);
+    int minVal = *std::min_element(currentRow, currentRow + queryLength + 1);
     if (minVal > maxEdits) return;
 
-    for (int i = 0; i < node->children.size(); ++i) {
-        TrieNode* child = node->children[i];
-        if (child == nullptr) continue;
-        char letter = 'A' + i;
+    int* nextRow = currentRow + queryLength + 1;
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeHasLength(child, queryLength - maxEdits, queryLength + maxEdits)) continue;
+        char letter = 'A' + __builtin_ctz(mask);
 
-        std::vector<int> nextRow(maxQueryLength_ + 1);
         nextRow[0] = currentRow[0] + 1;
         for (int j = 1; j <= queryLength; ++j) {
             int cost = (query[j - 1] == letter) ? 0 : 1;
@@ -359,35 +387,15 @@ void Trie::SearchRecursive(const std::string& query, int maxEdits, const std::st
                                     currentRow[j - 1] + cost
                                   });
         }
-        SearchRecursive(query, maxEdits, prefix + letter, child, nextRow, queryLength, results);
+        SearchRecursive(query, maxEdits, child, nextRow, queryLength, results);
     }
 }
 
 std::unordered_map<std::string, std::vector<std::string>> Trie::Search(const std::vector<std::string>& queries,
                                                                        int maxEdits) {
-    std::unordered_map<std::string, std::vector<std::string>> result;
-    std::vector<std::future<std::pair<std::string, std::vector<std::string>>>> futures;
-
-    std::size_t maxConcurrent = 10 * std::thread::hardware_concurrency();
-
-    for (std::size_t i = 0; i < queries.size(); ++i) {
-        const std::string& query = queries[i];
-
-        futures.emplace_back(std::async(std::launch::async,
-                                        [this, query, maxEdits]() -> std::pair<std::string, std::vector<std::string>> {
-                                            return { query, this->Search(query, maxEdits) };
-                                        }));
-
-        if (futures.size() >= maxConcurrent || i == queries.size() - 1) {
-            for (std::future<std::pair<std::string, std::vector<std::string>>>& fut : futures) {
-                std::pair<std::string, std::vector<std::string>> completed = fut.get();
-                result[std::move(completed.first)] = std::move(completed.second);
-            }
-            futures.clear();
-        }
-    }
-
-    return result;
+    return RunBatch<std::vector<std::string>>(queries, [this, maxEdits](const std::string& query) {
+        return Search(query, maxEdits);
+    });
 }
 
 std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchForAll(
@@ -397,42 +405,9 @@ std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchForAll(
         int maxDeletion,
         const std::optional<std::string>& vGeneFilter,
         const std::optional<std::string>& jGeneFilter) {
-
-    std::unordered_map<std::string, std::vector<AIRREntity>> result;
-    std::vector<std::future<std::pair<std::string, std::vector<AIRREntity>>>> futures;
-
-    std::size_t maxConcurrent = 10 * std::thread::hardware_concurrency();
-
-    for (std::size_t i = 0; i < queries.size(); ++i) {
-        const std::string& query = queries[i];
-
-        futures.emplace_back(std::async(std::launch::async,
-                                        [this,
-                                                query,
-                                                maxSubstitution,
-                                                maxInsertion,
-                                                maxDeletion,
-                                                vGeneFilter,
-                                                jGeneFilter]() -> std::pair<std::string, std::vector<AIRREntity>> {
-                                            return { query,
-                                                     this->SearchAIRR(query,
-                                                                      maxSubstitution,
-                                                                      maxInsertion,
-                                                                      maxDeletion,
-                                                                      vGeneFilter,
-                                                                      jGeneFilter) };
-                                        }));
-
-        if (futures.size() >= maxConcurrent || i == queries.size() - 1) {
-            for (std::future<std::pair<std::string, std::vector<AIRREntity>>>& fut : futures) {
-                std::pair<std::string, std::vector<AIRREntity>> completed = fut.get();
-                result[std::move(completed.first)] = std::move(completed.second);
-            }
-            futures.clear();
-        }
-    }
-
-    return result;
+    return RunBatch<std::vector<AIRREntity>>(queries, [&](const std::string& query) {
+        return SearchAIRR(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter);
+    });
 }
 
 std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchForAllWithMatrix(
@@ -440,74 +415,290 @@ std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchForAllWithM
         float maxCost,
         const std::optional<std::string>& vGeneFilter,
         const std::optional<std::string>& jGeneFilter) {
+    return RunBatch<std::vector<AIRREntity>>(queries, [&](const std::string& query) {
+        return SearchWithMatrix(query, maxCost, vGeneFilter, jGeneFilter);
+    });
+}
 
-    std::unordered_map<std::string, std::vector<AIRREntity>> result;
-    std::vector<std::future<std::pair<std::string, std::vector<AIRREntity>>>> futures;
+Trie::BatchMatches Trie::SearchForAllIndexed(const std::vector<std::string>& queries,
+                                             int maxSubstitution,
+                                             int maxInsertion,
+                                             int maxDeletion,
+                                             const std::optional<std::string>& vGeneFilter,
+                                             const std::optional<std::string>& jGeneFilter,
+                                             std::vector<SearchStats>* stats) {
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    return RunIndexedBatch(queries, filter, [&](const std::string& query, SearchStats* queryStats) {
+        return SearchAIRRClonotypes(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter,
+                                    queryStats);
+    }, stats);
+}
 
-    std::size_t maxConcurrent = 10 * std::thread::hardware_concurrency();
+Trie::BatchMatches Trie::SearchForAllWithMatrixIndexed(const std::vector<std::string>& queries,
+                                                       float maxCost,
+                                                       const std::optional<std::string>& vGeneFilter,
+                                                       const std::optional<std::string>& jGeneFilter,
+                                                       std::vector<SearchStats>* stats) {
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    return RunIndexedBatch(queries, filter, [&](const std::string& query, SearchStats* queryStats) {
+        return SearchWithMatrixClonotypes(query, maxCost, vGeneFilter, jGeneFilter, queryStats);
+    }, stats);
+}
 
-    for (std::size_t i = 0; i < queries.size(); ++i) {
-        const std::string& query = queries[i];
+std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchNearestForAll(
+        const std::vector<std::string>& queries,
+        size_t k,
+        const std::optional<std::string>& vGeneFilter,
+        const std::optional<std::string>& jGeneFilter) {
+    return RunBatch<std::vector<AIRREntity>>(queries, [&](const std::string& query) {
+        return SearchNearest(query, k, vGeneFilter, jGeneFilter);
+    });
+}
 
-        futures.push_back(std::async(std::launch::async,
-                                     [this, query, maxCost, vGeneFilter, jGeneFilter]() {
-                                         return std::make_pair(query, this->SearchWithMatrix(query,
-                                                                                             maxCost,
-                                                                                             vGeneFilter,
-                                                                                             jGeneFilter));
-                                     }));
+std::unordered_map<std::string, std::vector<AIRREntity>> Trie::SearchNearestForAllWithMatrix(
+        const std::vector<std::string>& queries,
+        size_t k,
+        const std::optional<std::string>& vGeneFilter,
+        const std::optional<std::string>& jGeneFilter) {
+    return RunBatch<std::vector<AIRREntity>>(queries, [&](const std::string& query) {
+        return SearchNearestWithMatrix(query, k, vGeneFilter, jGeneFilter);
+    });
+}
 
-        if (futures.size() >= maxConcurrent || i == queries.size() - 1) {
-            for (std::future<std::pair<std::string, std::vector<AIRREntity>>>& fut : futures) {
-                std::pair<std::string, std::vector<AIRREntity>> completed = fut.get();
-                result[std::move(completed.first)] = std::move(completed.second);
-            }
-            futures.clear();
+template <typename Result, typename SearchFn>
+std::unordered_map<std::string, Result> Trie::RunBatch(const std::vector<std::string>& queries,
+                                                       SearchFn search) {
+    // Each worker appends (query index, result) pairs to its own buffer; the
+    // buffers are merged into the map once the whole batch is done.
+    std::vector<size_t> first;
+    std::vector<size_t> distinct = DistinctQueries(queries, first);
+    std::shared_ptr<ThreadPool> pool = Pool();
+    std::vector<std::vector<std::pair<size_t, Result>>> buffers(pool->ThreadCount());
+
+    size_t chunkSize = std::clamp<size_t>(distinct.size() / (8 * pool->ThreadCount()), 1, 256);
+    pool->ParallelFor(distinct.size(), chunkSize, [&](size_t begin, size_t end, size_t worker) {
+        for (size_t n = begin; n < end; ++n) {
+            buffers[worker].emplace_back(distinct[n], search(queries[distinct[n]]));
+        }
+    });
+
+    std::unordered_map<std::string, Result> result;
+    result.reserve(distinct.size());
+    for (auto& buffer : buffers) {
+        for (auto& [index, matches] : buffer) {
+            result[queries[index]] = std::move(matches);
         }
     }
+    return result;
+}
 
-    for (auto& fut : futures) {
-        auto [query, matches] = fut.get();
-        result[query] = std::move(matches);
+template <typename SearchFn>
+Trie::BatchMatches Trie::RunIndexedBatch(const std::vector<std::string>& queries, const GeneFilter& filter,
+                                         SearchFn search, std::vector<SearchStats>* stats) {
+    // Each worker appends its matches to its own buffer and notes, per query,
+    // where they end; the buffers are then copied into the flat layout.
+    // Repeated queries are searched once and get a copy of the matches of
+    // their first occurrence.
+    struct Buffer {
+        std::vector<RecordMatch> matches;
+        std::vector<std::pair<size_t, size_t>> ends;
+    };
+    std::vector<size_t> first;
+    std::vector<size_t> distinct = DistinctQueries(queries, first);
+    std::shared_ptr<ThreadPool> pool = Pool();
+    std::vector<Buffer> buffers(pool->ThreadCount());
+    if (stats) {
+        stats->assign(queries.size(), SearchStats());
     }
 
+    size_t chunkSize = std::clamp<size_t>(distinct.size() / (8 * pool->ThreadCount()), 1, 256);
+    pool->ParallelFor(distinct.size(), chunkSize, [&](size_t begin, size_t end, size_t worker) {
+        Buffer& buffer = buffers[worker];
+        for (size_t n = begin; n < end; ++n) {
+            size_t i = distinct[n];
+            if (!stats) {
+                AppendRecordMatches(search(queries[i], nullptr), filter, buffer.matches);
+            } else {
+                SearchStats& queryStats = (*stats)[i];
+                std::vector<ClonotypeMatch> matches = search(queries[i], &queryStats);
+                StatsClock::time_point start = StatsClock::now();
+                size_t before = buffer.matches.size();
+                AppendRecordMatches(matches, filter, buffer.matches);
+                queryStats.matches += buffer.matches.size() - before;
+                queryStats.expandUs += MicrosecondsSince(start);
+            }
+            buffer.ends.emplace_back(i, buffer.matches.size());
+        }
+    });
+
+    BatchMatches result;
+    result.offsets.assign(queries.size() + 1, 0);
+    for (const Buffer& buffer : buffers) {
+        size_t begin = 0;
+        for (auto [query, end] : buffer.ends) {
+            result.offsets[query + 1] = end - begin;
+            begin = end;
+        }
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (first[i] != i) {
+            result.offsets[i + 1] = result.offsets[first[i] + 1];
+        }
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        result.offsets[i + 1] += result.offsets[i];
+    }
+    result.matches.resize(result.offsets.back());
+    for (const Buffer& buffer : buffers) {
+        size_t begin = 0;
+        for (auto [query, end] : buffer.ends) {
+            std::copy(buffer.matches.begin() + begin, buffer.matches.begin() + end,
+                      result.matches.begin() + result.offsets[query]);
+            begin = end;
+        }
+    }
+    for (size_t i = 0; i < queries.size(); ++i) {
+        if (first[i] == i) continue;
+        std::copy(result.matches.begin() + result.offsets[first[i]],
+                  result.matches.begin() + result.offsets[first[i] + 1],
+                  result.matches.begin() + result.offsets[i]);
+        if (stats) {
+            (*stats)[i] = (*stats)[first[i]];
+        }
+    }
     return result;
 }
 
+std::vector<size_t> Trie::DistinctQueries(const std::vector<std::string>& queries, std::vector<size_t>& first) {
+    std::unordered_map<std::string_view, size_t> seen;
+    seen.reserve(queries.size());
+    std::vector<size_t> distinct;
+    distinct.reserve(queries.size());
+    first.resize(queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        auto [it, inserted] = seen.emplace(queries[i], i);
+        first[i] = it->second;
+        if (inserted) {
+            distinct.push_back(i);
+        }
+    }
+    return distinct;
+}
+
+std::shared_ptr<ThreadPool> Trie::Pool() {
+    // Created on first use; atomic so that concurrent batch calls agree on one pool.
+    std::shared_ptr<ThreadPool> pool = std::atomic_load(&threadPool_);
+    if (!pool) {
+        auto created = std::make_shared<ThreadPool>();
+        if (std::atomic_compare_exchange_strong(&threadPool_, &pool, created)) {
+            pool = std::move(created);
+        }
+    }
+    return pool;
+}
+
+void Trie::SetThreadCount(size_t threadCount) {
+    std::atomic_store(&threadPool_, std::make_shared<ThreadPool>(threadCount));
+}
+
+void Trie::SetThreadPool(std::shared_ptr<ThreadPool> threadPool) {
+    std::atomic_store(&threadPool_, std::move(threadPool));
+}
+
+void Trie::SetResultCacheSize(size_t entries) {
+    resultCache_ = entries > 0 ? std::make_shared<ResultCache>(entries) : nullptr;
+}
+
+Trie::ResultCacheStats Trie::GetResultCacheStats() const {
+    ResultCacheStats stats;
+    if (resultCache_) {
+        stats.hits = resultCache_->Hits();
+        stats.misses = resultCache_->Misses();
+        stats.entries = resultCache_->Size();
+    }
+    return stats;
+}
+
+uint64_t Trie::NewResultGeneration() {
+    static std::atomic<uint64_t> next{ 0 };
+    return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+std::string Trie::ResultKey(char kind, std::initializer_list<double> params, const std::string& query,
+                            const std::optional<std::string>& vGeneFilter,
+                            const std::optional<std::string>& jGeneFilter) const {
+    std::string key;
+    if (!resultCache_) {
+        return key;
+    }
+    // Fixed-size fields first; the filters are length-prefixed, with
+    // UINT32_MAX standing for no filter, so that no two searches share a key.
+    auto appendBytes = [&key](const auto& value) {
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    };
+    auto appendFilter = [&](const std::optional<std::string>& filter) {
+        appendBytes(filter ? static_cast<uint32_t>(filter->size()) : UINT32_MAX);
+        if (filter) key += *filter;
+    };
+    key.reserve(sizeof(resultGeneration_) + 1 + params.size() * sizeof(double) + query.size() + 16);
+    appendBytes(resultGeneration_);
+    key += kind;
+    for (double param : params) {
+        appendBytes(param);
+    }
+    appendFilter(vGeneFilter);
+    appendFilter(jGeneFilter);
+    key += query;
+    return key;
+}
+
+std::shared_ptr<const std::vector<Trie::ClonotypeMatch>> Trie::FindResult(const std::string& key) const {
+    return key.empty() ? nullptr : resultCache_->Get(key);
+}
+
+void Trie::StoreResult(std::string key, const std::vector<ClonotypeMatch>& matches) const {
+    if (!key.empty()) {
+        resultCache_->Put(std::move(key), std::make_shared<const std::vector<ClonotypeMatch>>(matches));
+    }
+}
+
 bool Trie::SearchAny(const std::string& query, int maxEdits) {
     int queryLength = query.size();
     if (queryLength > maxQueryLength_) {
         std::cerr << "Query length exceeds maximum allowed length." << std::endl;
         return false;
     }
-    std::vector<int> initialRow(maxQueryLength_ + 1);
+    if (UseBitParallel(queryLength)) {
+        std::array<uint64_t, 26> peq = BuildPeq(query);
+        return SearchAnyRecursiveBitParallel(peq.data(), maxEdits, root_, InitialBitRow(queryLength), queryLength);
+    }
+    int* rows = ScratchRows<int>(maxDepth_ + 1, queryLength + 1);
     for (int i = 0; i <= queryLength; ++i) {
-        initialRow[i] = i;
+        rows[i] = i;
     }
 
-    return SearchAnyRecursive(query, maxEdits, root_, initialRow, queryLength);
+    return SearchAnyRecursive(query, maxEdits, root_, rows, queryLength);
 }
 
 bool Trie::SearchAnyRecursive(const std::string& query, int maxEdits,
-                              TrieNode* node, std::vector<int>& prevRow, int queryLength) {
-    std::vector<int> currentRow(maxQueryLength_ + 1);
-    std::copy(prevRow.begin(), prevRow.begin() + queryLength + 1, currentRow.begin());
+                              uint32_t nodeIndex, int* currentRow, int queryLength) {
+    const TrieNode& node = nodes_[nodeIndex];
 
-    if (!node->indices.empty() && currentRow[queryLength] <= maxEdits) {
-        for (int index : node->indices) {
-            return true;
-        }
+    if (node.indicesBegin != node.indicesEnd && currentRow[queryLength] <= maxEdits) {
+        return true;
     }
 
-    int minVal = *std::min_element(currentRow.begin(), currentRow.begin() + queryLength + 1);
+    int minVal = *std::min_element(currentRow, currentRow + queryLength + 1);
     if (minVal > maxEdits) return false;
 
-    for (int i = 0; i < node->children.size(); ++i) {
-        TrieNode* child = node->children[i];
-        if (child == nullptr) continue;
-        char letter = 'A' + i;
+    int* nextRow = currentRow + queryLength + 1;
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeHasLength(child, queryLength - maxEdits, queryLength + maxEdits)) continue;
+        char letter = 'A' + __builtin_ctz(mask);
 
-        std::vector<int> nextRow(maxQueryLength_ + 1);
         nextRow[0] = currentRow[0] + 1;
 
         for (int j = 1; j <= queryLength; ++j) {
@@ -527,52 +718,352 @@ bool Trie::SearchAnyRecursive(const std::string& query, int maxEdits,
     return false;
 }
 
+bool Trie::UseBitParallel(int queryLength) const {
+    return levenshteinKernel_ == LevenshteinKernel::BitParallel
+           && queryLength > 0 && queryLength <= 64;
+}
+
+void Trie::SearchRecursiveBitParallel(const uint64_t* peq, int maxEdits,
+                                      uint32_t nodeIndex, const BitRow& row, int queryLength,
+                                      std::vector<std::string>& results) {
+    const TrieNode& node = nodes_[nodeIndex];
+
+    if (node.indicesBegin != node.indicesEnd && row.score <= maxEdits) {
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            uint32_t clonotype = terminalIndices_[k];
+            const RecordRange& range = recordRanges_[clonotype];
+            results.insert(results.end(), range.end - range.begin, std::string(clonotypes_[clonotype]));
+        }
+    }
+
+    if (BitRowExceeds(row, queryLength, maxEdits)) return;
+
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeHasLength(child, queryLength - maxEdits, queryLength + maxEdits)) continue;
+        SearchRecursiveBitParallel(peq, maxEdits, child,
+                                   AdvanceBitRow(row, peq[__builtin_ctz(mask)], queryLength),
+                                   queryLength, results);
+    }
+}
+
+bool Trie::SearchAnyRecursiveBitParallel(const uint64_t* peq, int maxEdits,
+                                         uint32_t nodeIndex, const BitRow& row, int queryLength) {
+    const TrieNode& node = nodes_[nodeIndex];
+
+    if (node.indicesBegin != node.indicesEnd && row.score <= maxEdits) {
+        return true;
+    }
+
+    if (BitRowExceeds(row, queryLength, maxEdits)) return false;
+
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeHasLength(child, queryLength - maxEdits, queryLength + maxEdits)) continue;
+        if (SearchAnyRecursiveBitParallel(peq, maxEdits, child,
+                                          AdvanceBitRow(row, peq[__builtin_ctz(mask)], queryLength),
+                                          queryLength)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Builds the distinct-name dictionary of a per-sequence gene column and the
+// per-sequence ids into it, numbered in order of first appearance.
+static void InternGenes(const StringColumn& genes, StringColumn& names, Column<uint32_t>& ids) {
+    std::unordered_map<std::string_view, uint32_t> dictionary;
+    std::vector<uint32_t> geneIds(genes.size());
+    names.clear();
+    for (size_t i = 0; i < genes.size(); ++i) {
+        auto [it, inserted] = dictionary.emplace(genes[i], dictionary.size());
+        if (inserted) {
+            names.push_back(genes[i]);
+        }
+        geneIds[i] = it->second;
+    }
+    ids = Column<uint32_t>(std::move(geneIds));
+}
+
 void Trie::LoadAIRR(const std::string& dataPath) {
-    auto entries = ParseAIRR(dataPath);
-    for (auto& e : entries) {
-        sequences_.push_back(e.junctionAA);
-        vGenes_.push_back(e.vGene);
-        jGenes_.push_back(e.jGene);
-    }
-}
-
-void Trie::BuildTrie() {
-    for (int idx = 0; idx < sequences_.size(); ++idx) {
-        const auto& seq = sequences_[idx];
-        TrieNode* node = root_;
-        for (char c : seq) {
-            if (c < 'A' || c > 'Z') continue;
-            int i = c - 'A';
-            if (!node->children[i]) {
-                node->children[i] = new TrieNode();
+    StringColumn sequences, vGenes, jGenes;
+    ParseAIRRColumns(dataPath, *Pool(), sequences, vGenes, jGenes);
+    Column<uint32_t> vGeneIds, jGeneIds;
+    InternGenes(vGenes, vGeneNames_, vGeneIds);
+    InternGenes(jGenes, jGeneNames_, jGeneIds);
+    BuildTrie(sequences, vGeneIds, jGeneIds);
+}
+
+// Gene dictionaries hold a few hundred names at most, so a scan per query
+// is cheaper than keeping a hash map in sync with mapped indexes.
+static std::optional<uint32_t> FindGene(const StringColumn& names, std::string_view name) {
+    for (size_t id = 0; id < names.size(); ++id) {
+        if (names[id] == name) return id;
+    }
+    return std::nullopt;
+}
+
+std::optional<uint32_t> Trie::FindVGene(std::string_view name) const {
+    return FindGene(vGeneNames_, name);
+}
+
+std::optional<uint32_t> Trie::FindJGene(std::string_view name) const {
+    return FindGene(jGeneNames_, name);
+}
+
+bool Trie::ResolveGeneFilter(const std::optional<std::string>& vGeneFilter,
+                             const std::optional<std::string>& jGeneFilter,
+                             GeneFilter& filter) const {
+    if (vGeneFilter) {
+        std::optional<uint32_t> id = FindVGene(*vGeneFilter);
+        if (!id) return false;
+        filter.vGene = *id;
+        filter.required.vGenes = uint64_t{1} << (*id % 64);
+    }
+    if (jGeneFilter) {
+        std::optional<uint32_t> id = FindJGene(*jGeneFilter);
+        if (!id) return false;
+        filter.jGene = *id;
+        filter.required.jGenes = uint64_t{1} << (*id % 64);
+    }
+    return true;
+}
+
+bool Trie::AnyRecordAdmitted(uint32_t clonotype, const GeneFilter& filter) const {
+    auto [begin, end] = ClonotypeRecords(clonotype);
+    return std::any_of(begin, end, [&filter](const CloneRecord& record) {
+        return filter.Admits(record.vGene, record.jGene);
+    });
+}
+
+uint64_t Trie::AdmittedRecords(uint32_t clonotype, const GeneFilter& filter) const {
+    auto [begin, end] = ClonotypeRecords(clonotype);
+    if (!filter.Active()) {
+        return end - begin;
+    }
+    return std::count_if(begin, end, [&filter](const CloneRecord& record) {
+        return filter.Admits(record.vGene, record.jGene);
+    });
+}
+
+void Trie::CollectClonotypes(uint32_t nodeIndex, double distance, const GeneFilter& filter,
+                             std::vector<ClonotypeMatch>& results) const {
+    const TrieNode& node = nodes_[nodeIndex];
+    for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+        uint32_t clonotype = terminalIndices_[k];
+        if (!filter.Active() || AnyRecordAdmitted(clonotype, filter)) {
+            results.push_back({ clonotype, distance });
+        }
+    }
+}
+
+std::vector<AIRREntity> Trie::ExpandRecords(const std::vector<ClonotypeMatch>& matches,
+                                            const GeneFilter& filter) const {
+    std::vector<AIRREntity> results;
+    for (const auto& match : matches) {
+        auto [begin, end] = ClonotypeRecords(match.clonotype);
+        for (const CloneRecord* record = begin; record != end; ++record) {
+            if (filter.Admits(record->vGene, record->jGene)) {
+                results.emplace_back(clonotypes_[match.clonotype],
+                                     vGeneNames_[record->vGene],
+                                     jGeneNames_[record->jGene],
+                                     match.distance);
             }
-            node = node->children[i];
         }
-        node->indices.push_back(idx);
     }
+    return results;
 }
 
-void Trie::DeleteTrie(TrieNode* node) {
-    if (!node) return;
-    for (TrieNode* childNode : node->children) {
-        DeleteTrie(childNode);
+void Trie::AppendRecordMatches(const std::vector<ClonotypeMatch>& matches, const GeneFilter& filter,
+                               std::vector<RecordMatch>& results) const {
+    for (const auto& match : matches) {
+        const RecordRange& range = recordRanges_[match.clonotype];
+        for (uint32_t record = range.begin; record < range.end; ++record) {
+            if (filter.Admits(records_[record].vGene, records_[record].jGene)) {
+                results.push_back({ match.clonotype, record, match.distance });
+            }
+        }
     }
-    delete node;
 }
 
-Trie::TrieNode* Trie::CopyTrie(const TrieNode* node) {
-    if (!node) return nullptr;
+void Trie::BuildTrie(const StringColumn& sequences,
+                     const Column<uint32_t>& vGeneIds, const Column<uint32_t>& jGeneIds,
+                     const std::vector<uint32_t>* rowIds) {
+    // Rows sorted by junction (ties by row) form one run per clonotype.
+    std::vector<uint32_t> rows(sequences.size());
+    for (size_t row = 0; row < rows.size(); ++row) {
+        rows[row] = row;
+    }
+    std::stable_sort(rows.begin(), rows.end(),
+                     [&sequences](uint32_t a, uint32_t b) { return sequences[a] < sequences[b]; });
+
+    StringColumn clonotypes;
+    std::vector<RecordRange> recordRanges;
+    std::vector<CloneRecord> records;
+    records.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (i == 0 || sequences[rows[i]] != sequences[rows[i - 1]]) {
+            clonotypes.push_back(sequences[rows[i]]);
+            recordRanges.push_back({ static_cast<uint32_t>(records.size()), 0 });
+        }
+        uint32_t row = rowIds ? (*rowIds)[rows[i]] : rows[i];
+        records.push_back({ vGeneIds[rows[i]], jGeneIds[rows[i]], row });
+        recordRanges.back().end = records.size();
+        nextRow_ = std::max(nextRow_, row + 1);
+    }
+    clonotypes_ = std::move(clonotypes);
+    recordRanges_ = Column<RecordRange>(std::move(recordRanges));
+    records_ = Column<CloneRecord>(std::move(records));
+
+    // Only letters 'A'..'Z' take part in the trie path; other characters are
+    // dropped from the key, as before.
+    std::vector<std::string_view> keys(clonotypes_.size());
+    std::vector<std::string> filteredKeys;
+    std::vector<size_t> filteredOwners;
+    for (size_t idx = 0; idx < clonotypes_.size(); ++idx) {
+        const auto& seq = clonotypes_[idx];
+        bool clean = std::all_of(seq.begin(), seq.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+        if (clean) {
+            keys[idx] = seq;
+            continue;
+        }
+        std::string key;
+        std::copy_if(seq.begin(), seq.end(), std::back_inserter(key),
+                     [](char c) { return c >= 'A' && c <= 'Z'; });
+        filteredKeys.push_back(std::move(key));
+        filteredOwners.push_back(idx);
+    }
+    for (size_t k = 0; k < filteredKeys.size(); ++k) {
+        keys[filteredOwners[k]] = filteredKeys[k];
+    }
 
-    TrieNode* newNode = new TrieNode();
-    newNode->indices = node->indices;
+    std::vector<int> order(clonotypes_.size());
+    for (size_t idx = 0; idx < order.size(); ++idx) {
+        order[idx] = idx;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&keys](int a, int b) { return keys[a] < keys[b]; });
+
+    std::vector<TrieNode> nodes(1);
+    std::vector<int> terminalIndices;
+    terminalIndices.reserve(order.size());
+    maxDepth_ = 0;
+    BuildSubtree(keys, order, 0, order.size(), 0, 0, nodes, terminalIndices);
+    nodes.shrink_to_fit();
+    nodes_ = Column<TrieNode>(std::move(nodes));
+    terminalIndices_ = Column<int>(std::move(terminalIndices));
+    BuildGeneMasks();
+    BuildLengthRanges();
+    BuildSubtreeRecords();
+    compacted_ = true;
+    garbage_ = 0;
+    // Fresh columns: nothing a snapshot sees is shared with them.
+    root_ = 0;
+    frozenNodes_ = frozenTerminals_ = frozenRecords_ = frozenClonotypes_ = 0;
+    InvalidateResults();
+}
 
-    for (size_t i = 0; i < node->children.size(); ++i) {
-        if (node->children[i]) {
-            newNode->children[i] = CopyTrie(node->children[i]);
+void Trie::BuildGeneMasks() {
+    // Children are always stored after their parent, so a reverse sweep sees
+    // every child's mask before the parent's.
+    std::vector<GeneMasks> masks(nodes_.size());
+    for (size_t n = nodes_.size(); n-- > 0; ) {
+        const TrieNode& node = nodes_[n];
+        GeneMasks& mask = masks[n];
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            auto [begin, end] = ClonotypeRecords(terminalIndices_[k]);
+            for (const CloneRecord* record = begin; record != end; ++record) {
+                mask.vGenes |= uint64_t{1} << (record->vGene % 64);
+                mask.jGenes |= uint64_t{1} << (record->jGene % 64);
+            }
+        }
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            mask.vGenes |= masks[child].vGenes;
+            mask.jGenes |= masks[child].jGenes;
         }
     }
+    geneMasks_ = Column<GeneMasks>(std::move(masks));
+}
+
+void Trie::BuildLengthRanges() {
+    // Depths come from a forward sweep (parents first), ranges from a
+    // reverse one (children first).
+    std::vector<uint32_t> depths(nodes_.size(), 0);
+    for (size_t n = 0; n < nodes_.size(); ++n) {
+        const TrieNode& node = nodes_[n];
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            depths[child] = depths[n] + 1;
+        }
+    }
+
+    std::vector<LengthRange> ranges(nodes_.size());
+    for (size_t n = nodes_.size(); n-- > 0; ) {
+        const TrieNode& node = nodes_[n];
+        LengthRange& range = ranges[n];
+        if (node.indicesBegin != node.indicesEnd) {
+            range.minLength = depths[n];
+            range.maxLength = depths[n];
+        }
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            range.minLength = std::min(range.minLength, ranges[child].minLength);
+            range.maxLength = std::max(range.maxLength, ranges[child].maxLength);
+        }
+    }
+    lengthRanges_ = Column<LengthRange>(std::move(ranges));
+}
 
-    return newNode;
+void Trie::BuildSubtreeRecords() {
+    std::vector<uint32_t> counts(nodes_.size(), 0);
+    for (size_t n = nodes_.size(); n-- > 0; ) {
+        const TrieNode& node = nodes_[n];
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            const RecordRange& range = recordRanges_[terminalIndices_[k]];
+            counts[n] += range.end - range.begin;
+        }
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            counts[n] += counts[child];
+        }
+    }
+    subtreeRecords_ = Column<uint32_t>(std::move(counts));
+}
+
+void Trie::BuildSubtree(const std::vector<std::string_view>& keys,
+                        std::vector<int>& order, size_t begin, size_t end,
+                        size_t depth, uint32_t nodeIndex,
+                        std::vector<TrieNode>& nodes, std::vector<int>& terminalIndices) {
+    // order[begin, end) is sorted and shares the first `depth` letters, so the
+    // sequences ending here come first and each child owns a contiguous run.
+    maxDepth_ = std::max(maxDepth_, depth);
+    nodes[nodeIndex].indicesBegin = terminalIndices.size();
+    while (begin < end && keys[order[begin]].size() == depth) {
+        terminalIndices.push_back(order[begin++]);
+    }
+    nodes[nodeIndex].indicesEnd = terminalIndices.size();
+
+    uint32_t childMask = 0;
+    for (size_t i = begin; i < end; ++i) {
+        childMask |= 1u << (keys[order[i]][depth] - 'A');
+    }
+    if (childMask == 0) return;
+
+    uint32_t firstChild = nodes.size();
+    nodes[nodeIndex].childMask = childMask;
+    nodes[nodeIndex].firstChild = firstChild;
+    nodes.resize(nodes.size() + __builtin_popcount(childMask));
+
+    uint32_t child = firstChild;
+    while (begin < end) {
+        char letter = keys[order[begin]][depth];
+        size_t runEnd = begin;
+        while (runEnd < end && keys[order[runEnd]][depth] == letter) ++runEnd;
+        BuildSubtree(keys, order, begin, runEnd, depth + 1, child++, nodes, terminalIndices);
+        begin = runEnd;
+    }
 }
 
 void Trie::LoadSubstitutionMatrix(const std::string& matrixPath) {
@@ -624,7 +1115,9 @@ void Trie::LoadSubstitutionMatrix(const std::string& matrixPath) {
         }
     }
 
+    BuildCostTable();
     useSubstitutionMatrix_ = true;
+    InvalidateResults();
 
     std::cout << "Substitution-Score Matrix:" << std::endl;
     PrintMatrix();
@@ -657,8 +1150,59 @@ void Trie::PrintMatrix() {
     }
 }
 
+int Trie::ResidueCode(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c == '-') return kGapCode;
+    return -1;
+}
+
+void Trie::BuildCostTable() {
+    costTable_.fill(kMissingCost);
+    for (const auto& [row, columns] : substitutionMatrix_) {
+        int rowCode = ResidueCode(row);
+        if (rowCode < 0) continue;
+        for (const auto& [column, cost] : columns) {
+            int columnCode = ResidueCode(column);
+            if (columnCode < 0) continue;
+            costTable_[rowCode * kCostTableStride + columnCode] = cost;
+        }
+    }
+}
+
+const float* Trie::BuildQueryProfile(const std::string& query) const {
+    // Per-query profile: for every residue code c, row c holds the cost of
+    // deleting c at index 0 and of substituting c for query[j - 1] at index j.
+    // The gap row instead holds the cost of inserting query[j - 1].
+    int queryLength = query.size();
+    int stride = queryLength + 1;
+    thread_local std::vector<float> profile;
+    profile.resize(kResidueCodes * stride);
+
+    const float* gapCosts = costTable_.data() + kGapCode * kCostTableStride;
+    for (int c = 0; c < kResidueCodes; ++c) {
+        float* row = profile.data() + c * stride;
+        row[0] = gapCosts[c];
+        for (int j = 1; j <= queryLength; ++j) {
+            int queryCode = ResidueCode(query[j - 1]);
+            if (queryCode < 0) {
+                row[j] = kMissingCost;
+            } else if (c == kGapCode) {
+                row[j] = gapCosts[queryCode];
+            } else {
+                row[j] = costTable_[queryCode * kCostTableStride + c];
+            }
+        }
+    }
+    return profile.data();
+}
+
 void Trie::SetMaxQueryLength(int newMaxQueryLength) {
     maxQueryLength_ = newMaxQueryLength;
+    InvalidateResults();
+}
+
+void Trie::SetLevenshteinKernel(LevenshteinKernel kernel) {
+    levenshteinKernel_ = kernel;
 }
 
 void Trie::UpdateSubstitutionMatrix(float deletionScore) {
@@ -682,7 +1226,9 @@ void Trie::SetDeletionScore(float deletionScore) {
     if (useSubstitutionMatrix_) {
         std::cout << "New Substitution-Score Matrix:" << std::endl;
         UpdateSubstitutionMatrix(deletionScore);
+        BuildCostTable();
         PrintMatrix();
     }
     deletionScore_ = deletionScore;
+    InvalidateResults();
 }
\ No newline at end of file
@@ -0,0 +1,144 @@
+#include "Trie.h"
+
+#include <algorithm>
+
+// Count-only searches. The edit-budget count runs the DP of
+// VisitRecursiveAIRR, but a child whose keys are all within the budgets is
+// counted from subtreeRecords_ instead of being entered. Cell (j, d) of the
+// child row, with s substitutions, leaves q = queryLength - j query letters
+// against a key suffix of r letters. Substituting min(r, q) of them and
+// inserting (r > q) or deleting (q > r) the rest finishes the alignment
+// whatever the letters are, and each of the three counts is largest at one
+// end of the child's length range, so checking those ends covers every key.
+// Gene summaries are inexact, so under a filter every terminal is checked.
+
+uint64_t Trie::Count(const std::string& query, int maxSubstitution, int maxInsertion, int maxDeletion,
+                     const std::optional<std::string>& vGeneFilter,
+                     const std::optional<std::string>& jGeneFilter) {
+    EditSearch search;
+    if (!PrepareEditSearch(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter, search)) {
+        return 0;
+    }
+    return CountRecursiveAIRR(query, search, root_, 0, search.rows);
+}
+
+uint64_t Trie::CountWithMatrix(const std::string& query, float maxCost,
+                               const std::optional<std::string>& vGeneFilter,
+                               const std::optional<std::string>& jGeneFilter) {
+    // How much a residue-independent bound would overestimate depends on
+    // the residues of the matrix, so matrix counts take every terminal.
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    uint64_t count = 0;
+    VisitWithMatrix(query, maxCost, [&](uint32_t clonotype, double) {
+        count += AdmittedRecords(clonotype, filter);
+        return VisitAction::Continue;
+    }, vGeneFilter, jGeneFilter);
+    return count;
+}
+
+uint64_t Trie::CountRecursiveAIRR(const std::string& query, const EditSearch& search,
+                                  uint32_t nodeIndex, int depth, int* currentRow) const {
+    const TrieNode& node = nodes_[nodeIndex];
+    const EditBudget& budget = search.budget;
+    const int queryLength = search.queryLength;
+    const int slots = budget.deletions + 1;
+    uint64_t count = 0;
+
+    if (node.indicesBegin != node.indicesEnd) {
+        const int* last = currentRow + queryLength * slots;
+        if (std::any_of(last, last + slots, [](int cell) { return cell != kUnreachable; })) {
+            for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+                count += AdmittedRecords(terminalIndices_[k], search.filter);
+            }
+        }
+    }
+
+    const bool bulk = !search.filter.Active();
+    int* nextRow = currentRow + (queryLength + 1) * slots;
+    const int nextDepth = depth + 1;
+    uint32_t child = node.firstChild;
+    for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+        if (!SubtreeMayMatch(child, search.filter)
+            || !SubtreeHasLength(child, queryLength - budget.deletions, queryLength + budget.insertions)) {
+            continue;
+        }
+        char letter = 'A' + __builtin_ctz(mask);
+        const LengthRange& lengths = lengthRanges_[child];
+        const int64_t minSuffix = static_cast<int64_t>(lengths.minLength) - nextDepth;
+        const int64_t maxSuffix = static_cast<int64_t>(lengths.maxLength) - nextDepth;
+
+        if (!AdvanceEditRow(query, budget, lengths, nextDepth, letter, currentRow, nextRow)) continue;
+
+        // A covering cell pays maxSuffix - queryLeft insertions and
+        // queryLeft - minSuffix deletions, which bounds queryLeft from both
+        // sides; past the substitution budget, also from above by it. Its
+        // substitutions and insertions add up to at least maxSuffix, so
+        // only children whose deepest key lies within S + I letters below
+        // them are scanned: on CDR3 tries, the last few levels.
+        bool covered = false;
+        if (bulk && maxSuffix <= budget.substitutions + budget.insertions
+            && maxSuffix - minSuffix <= budget.insertions + budget.deletions) {
+            int64_t maxLeft = minSuffix + budget.deletions;
+            if (maxSuffix > budget.substitutions) maxLeft = std::min<int64_t>(maxLeft, budget.substitutions);
+            const int64_t minLeft = maxSuffix - budget.insertions;
+            const int firstJ = std::max<int64_t>(queryLength - maxLeft, 0);
+            const int lastJ = std::min<int64_t>(queryLength - minLeft, queryLength);
+            for (int j = firstJ; j <= lastJ && !covered; ++j) {
+                const int* cell = nextRow + j * slots;
+                const int64_t queryLeft = queryLength - j;
+                for (int d = 0; d < slots && !covered; ++d) {
+                    int insertions = d + nextDepth - j;
+                    covered = cell[d] != kUnreachable
+                              && cell[d] + std::min(maxSuffix, queryLeft) <= budget.substitutions
+                              && insertions + std::max<int64_t>(maxSuffix - queryLeft, 0) <= budget.insertions
+                              && d + std::max<int64_t>(queryLeft - minSuffix, 0) <= budget.deletions;
+                }
+            }
+        }
+        if (covered) {
+            count += subtreeRecords_[child];
+        } else {
+            count += CountRecursiveAIRR(query, search, child, nextDepth, nextRow);
+        }
+    }
+    return count;
+}
+
+template <typename CountFn>
+std::vector<uint64_t> Trie::RunCountBatch(const std::vector<std::string>& queries, CountFn count) {
+    std::vector<size_t> first;
+    std::vector<size_t> distinct = DistinctQueries(queries, first);
+    std::vector<uint64_t> counts(queries.size(), 0);
+    std::shared_ptr<ThreadPool> pool = Pool();
+    size_t chunkSize = std::clamp<size_t>(distinct.size() / (8 * pool->ThreadCount()), 1, 256);
+    pool->ParallelFor(distinct.size(), chunkSize, [&](size_t begin, size_t end, size_t) {
+        for (size_t n = begin; n < end; ++n) {
+            counts[distinct[n]] = count(queries[distinct[n]]);
+        }
+    });
+    for (size_t i = 0; i < queries.size(); ++i) {
+        counts[i] = counts[first[i]];
+    }
+    return counts;
+}
+
+std::vector<uint64_t> Trie::CountForAll(const std::vector<std::string>& queries,
+                                        int maxSubstitution,
+                                        int maxInsertion,
+                                        int maxDeletion,
+                                        const std::optional<std::string>& vGeneFilter,
+                                        const std::optional<std::string>& jGeneFilter) {
+    return RunCountBatch(queries, [&](const std::string& query) {
+        return Count(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter);
+    });
+}
+
+std::vector<uint64_t> Trie::CountForAllWithMatrix(const std::vector<std::string>& queries,
+                                                  float maxCost,
+                                                  const std::optional<std::string>& vGeneFilter,
+                                                  const std::optional<std::string>& jGeneFilter) {
+    return RunCountBatch(queries, [&](const std::string& query) {
+        return CountWithMatrix(query, maxCost, vGeneFilter, jGeneFilter);
+    });
+}
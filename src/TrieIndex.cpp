@@ -0,0 +1,301 @@
+#include "Trie.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk index layout (host byte order, checked through endianTag):
+//   IndexHeader, IndexSection[sectionCount], then each section's raw array
+//   starting at a 64-byte aligned offset. Bump kIndexVersion whenever
+//   IndexHeader, TrieNode or the set of sections changes.
+static constexpr char kIndexMagic[8] = {'T', 'C', 'R', 'T', 'R', 'I', 'E', '\0'};
+static constexpr uint32_t kIndexVersion = 8;
+static constexpr uint32_t kEndianTag = 0x01020304;
+static constexpr uint64_t kSectionAlignment = 64;
+
+// IndexHeader::flags bit: the trie was saved after Insert or Erase without
+// being compacted since.
+static constexpr uint32_t kUncompactedFlag = 1;
+
+enum IndexSectionId : uint32_t {
+    kNodesSection,
+    kTerminalIndicesSection,
+    kGeneMasksSection,
+    kLengthRangesSection,
+    kSubtreeRecordsSection,
+    kClonotypeOffsetsSection,
+    kClonotypeCharsSection,
+    kRecordRangesSection,
+    kRecordsSection,
+    kVGeneNameOffsetsSection,
+    kVGeneNameCharsSection,
+    kJGeneNameOffsetsSection,
+    kJGeneNameCharsSection,
+    kSectionCount
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianTag;
+    uint32_t sectionCount;
+    uint32_t flags;
+    uint64_t maxDepth;
+    uint64_t nextRow;
+    uint32_t root;
+    uint32_t reserved;
+    // Slots left unreachable by Insert and Erase (Trie::garbage_), so that
+    // a reloaded trie still compacts once they make up half its storage.
+    uint64_t garbage;
+};
+
+struct IndexSection {
+    uint32_t id;
+    uint32_t elementSize;
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct SectionData {
+    const void* data;
+    uint32_t elementSize;
+    uint64_t count;
+};
+
+template <typename T>
+static SectionData Section(const Column<T>& column) {
+    return { column.data(), sizeof(T), column.size() };
+}
+
+// Offsets of a packed string section: count + 1 of them, starting at 0,
+// never decreasing and ending within the chars.
+static bool ValidOffsets(const uint64_t* offsets, uint64_t count, uint64_t charCount) {
+    if (offsets[0] != 0 || offsets[count] > charCount) return false;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (offsets[i] > offsets[i + 1]) return false;
+    }
+    return true;
+}
+
+static uint64_t AlignUp(uint64_t offset) {
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+bool Trie::SaveIndex(const std::string& indexPath) const {
+    SectionData sections[kSectionCount] = {
+            Section(nodes_),
+            Section(terminalIndices_),
+            Section(geneMasks_),
+            Section(lengthRanges_),
+            Section(subtreeRecords_),
+            Section(clonotypes_.Offsets()),
+            Section(clonotypes_.Chars()),
+            Section(recordRanges_),
+            Section(records_),
+            Section(vGeneNames_.Offsets()),
+            Section(vGeneNames_.Chars()),
+            Section(jGeneNames_.Offsets()),
+            Section(jGeneNames_.Chars()),
+    };
+
+    IndexHeader header{};
+    std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+    header.version = kIndexVersion;
+    header.endianTag = kEndianTag;
+    header.sectionCount = kSectionCount;
+    header.flags = compacted_ ? 0 : kUncompactedFlag;
+    header.maxDepth = maxDepth_;
+    header.nextRow = nextRow_;
+    header.root = root_;
+    header.garbage = garbage_;
+
+    IndexSection table[kSectionCount];
+    uint64_t offset = AlignUp(sizeof(header) + sizeof(table));
+    for (uint32_t id = 0; id < kSectionCount; ++id) {
+        table[id] = { id, sections[id].elementSize, offset, sections[id].count };
+        offset = AlignUp(offset + sections[id].count * sections[id].elementSize);
+    }
+
+    std::ofstream out(indexPath, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Error: Unable to write index " << indexPath << std::endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(table), sizeof(table));
+    uint64_t written = sizeof(header) + sizeof(table);
+    static const char padding[kSectionAlignment] = {};
+    for (uint32_t id = 0; id < kSectionCount; ++id) {
+        out.write(padding, table[id].offset - written);
+        uint64_t bytes = sections[id].count * sections[id].elementSize;
+        out.write(static_cast<const char*>(sections[id].data), bytes);
+        written = table[id].offset + bytes;
+    }
+    if (!out) {
+        std::cerr << "Error: Failed to write index " << indexPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Trie::LoadIndex(const std::string& indexPath) {
+    int fd = open(indexPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Error: Unable to open index " << indexPath << std::endl;
+        return false;
+    }
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < sizeof(IndexHeader)) {
+        std::cerr << "Error: " << indexPath << " is not a TCRtrie index" << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t fileSize = info.st_size;
+    void* address = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        std::cerr << "Error: Unable to map index " << indexPath << std::endl;
+        return false;
+    }
+    std::shared_ptr<const void> mapping(address, [fileSize](const void* p) {
+        munmap(const_cast<void*>(p), fileSize);
+    });
+    const char* base = static_cast<const char*>(address);
+
+    IndexHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0
+        || header.endianTag != kEndianTag) {
+        std::cerr << "Error: " << indexPath << " is not a TCRtrie index" << std::endl;
+        return false;
+    }
+    if (header.version != kIndexVersion || header.sectionCount != kSectionCount
+        || sizeof(header) + kSectionCount * sizeof(IndexSection) > fileSize) {
+        std::cerr << "Error: " << indexPath << " has unsupported index version " << header.version
+                  << " (expected " << kIndexVersion << "), rebuild it with --save-index" << std::endl;
+        return false;
+    }
+
+    static constexpr uint32_t kElementSizes[kSectionCount] = {
+            sizeof(TrieNode), sizeof(int), sizeof(GeneMasks), sizeof(LengthRange), sizeof(uint32_t),
+            sizeof(uint64_t), sizeof(char),
+            sizeof(RecordRange), sizeof(CloneRecord),
+            sizeof(uint64_t), sizeof(char),
+            sizeof(uint64_t), sizeof(char),
+    };
+    IndexSection table[kSectionCount];
+    std::memcpy(table, base + sizeof(header), sizeof(table));
+    for (uint32_t id = 0; id < kSectionCount; ++id) {
+        if (table[id].id != id || table[id].elementSize != kElementSizes[id]
+            || table[id].offset % kSectionAlignment != 0
+            || table[id].offset > fileSize
+            || table[id].count > (fileSize - table[id].offset) / table[id].elementSize) {
+            std::cerr << "Error: " << indexPath << " is truncated or corrupt" << std::endl;
+            return false;
+        }
+    }
+    uint64_t clonotypes = table[kClonotypeOffsetsSection].count;
+    if (header.root >= table[kNodesSection].count || clonotypes == 0
+        || table[kGeneMasksSection].count != table[kNodesSection].count
+        || table[kLengthRangesSection].count != table[kNodesSection].count
+        || table[kSubtreeRecordsSection].count != table[kNodesSection].count
+        || table[kRecordRangesSection].count != clonotypes - 1
+        || table[kVGeneNameOffsetsSection].count == 0
+        || table[kJGeneNameOffsetsSection].count == 0) {
+        std::cerr << "Error: " << indexPath << " is truncated or corrupt" << std::endl;
+        return false;
+    }
+
+    auto at = [base, &table](IndexSectionId id) { return base + table[id].offset; };
+
+    // The searches follow child blocks, terminal ranges, clonotype ids,
+    // record ranges and gene ids without checking them, so one pass checks
+    // that they stay in bounds before anything is published. The DP scratch
+    // is sized from maxDepth, which is recomputed from the reachable nodes;
+    // walking them also rejects child links that form a cycle.
+    const TrieNode* nodes = reinterpret_cast<const TrieNode*>(at(kNodesSection));
+    const int* terminals = reinterpret_cast<const int*>(at(kTerminalIndicesSection));
+    const RecordRange* recordRanges = reinterpret_cast<const RecordRange*>(at(kRecordRangesSection));
+    const CloneRecord* records = reinterpret_cast<const CloneRecord*>(at(kRecordsSection));
+    const uint64_t nodeCount = table[kNodesSection].count;
+    const uint64_t terminalCount = table[kTerminalIndicesSection].count;
+    const uint64_t recordCount = table[kRecordsSection].count;
+    const uint64_t vGeneCount = table[kVGeneNameOffsetsSection].count - 1;
+    const uint64_t jGeneCount = table[kJGeneNameOffsetsSection].count - 1;
+    bool valid = ValidOffsets(reinterpret_cast<const uint64_t*>(at(kClonotypeOffsetsSection)), clonotypes - 1,
+                              table[kClonotypeCharsSection].count)
+                 && ValidOffsets(reinterpret_cast<const uint64_t*>(at(kVGeneNameOffsetsSection)), vGeneCount,
+                                 table[kVGeneNameCharsSection].count)
+                 && ValidOffsets(reinterpret_cast<const uint64_t*>(at(kJGeneNameOffsetsSection)), jGeneCount,
+                                 table[kJGeneNameCharsSection].count);
+    for (uint64_t n = 0; valid && n < nodeCount; ++n) {
+        const TrieNode& node = nodes[n];
+        valid = node.childMask < (1u << 26)
+                && static_cast<uint64_t>(node.firstChild) + __builtin_popcount(node.childMask) <= nodeCount
+                && node.indicesBegin <= node.indicesEnd && node.indicesEnd <= terminalCount;
+    }
+    for (uint64_t k = 0; valid && k < terminalCount; ++k) {
+        valid = terminals[k] >= 0 && static_cast<uint64_t>(terminals[k]) < clonotypes - 1;
+    }
+    for (uint64_t c = 0; valid && c + 1 < clonotypes; ++c) {
+        valid = recordRanges[c].begin <= recordRanges[c].end && recordRanges[c].end <= recordCount;
+    }
+    for (uint64_t r = 0; valid && r < recordCount; ++r) {
+        valid = records[r].vGene < vGeneCount && records[r].jGene < jGeneCount;
+    }
+    uint64_t maxDepth = 0;
+    if (valid) {
+        std::vector<std::pair<uint32_t, uint64_t>> stack{ { header.root, 0 } };
+        uint64_t visited = 0;
+        while (!stack.empty() && valid) {
+            auto [nodeIndex, depth] = stack.back();
+            stack.pop_back();
+            maxDepth = std::max(maxDepth, depth);
+            valid = ++visited <= nodeCount;
+            const TrieNode& node = nodes[nodeIndex];
+            for (uint32_t k = 0; k < static_cast<uint32_t>(__builtin_popcount(node.childMask)); ++k) {
+                stack.push_back({ node.firstChild + k, depth + 1 });
+            }
+        }
+    }
+    if (!valid) {
+        std::cerr << "Error: " << indexPath << " is truncated or corrupt" << std::endl;
+        return false;
+    }
+    nodes_.View(mapping, reinterpret_cast<const TrieNode*>(at(kNodesSection)), table[kNodesSection].count);
+    terminalIndices_.View(mapping, reinterpret_cast<const int*>(at(kTerminalIndicesSection)),
+                          table[kTerminalIndicesSection].count);
+    geneMasks_.View(mapping, reinterpret_cast<const GeneMasks*>(at(kGeneMasksSection)),
+                    table[kGeneMasksSection].count);
+    lengthRanges_.View(mapping, reinterpret_cast<const LengthRange*>(at(kLengthRangesSection)),
+                       table[kLengthRangesSection].count);
+    subtreeRecords_.View(mapping, reinterpret_cast<const uint32_t*>(at(kSubtreeRecordsSection)),
+                         table[kSubtreeRecordsSection].count);
+    clonotypes_.View(mapping,
+                     reinterpret_cast<const uint64_t*>(at(kClonotypeOffsetsSection)), clonotypes - 1,
+                     at(kClonotypeCharsSection), table[kClonotypeCharsSection].count);
+    recordRanges_.View(mapping, reinterpret_cast<const RecordRange*>(at(kRecordRangesSection)), clonotypes - 1);
+    records_.View(mapping, reinterpret_cast<const CloneRecord*>(at(kRecordsSection)),
+                  table[kRecordsSection].count);
+    vGeneNames_.View(mapping,
+                     reinterpret_cast<const uint64_t*>(at(kVGeneNameOffsetsSection)),
+                     table[kVGeneNameOffsetsSection].count - 1,
+                     at(kVGeneNameCharsSection), table[kVGeneNameCharsSection].count);
+    jGeneNames_.View(mapping,
+                     reinterpret_cast<const uint64_t*>(at(kJGeneNameOffsetsSection)),
+                     table[kJGeneNameOffsetsSection].count - 1,
+                     at(kJGeneNameCharsSection), table[kJGeneNameCharsSection].count);
+    maxDepth_ = maxDepth;
+    nextRow_ = header.nextRow;
+    root_ = header.root;
+    frozenNodes_ = frozenTerminals_ = frozenRecords_ = frozenClonotypes_ = 0;
+    compacted_ = (header.flags & kUncompactedFlag) == 0;
+    garbage_ = header.garbage;
+    InvalidateResults();
+    return true;
+}
@@ -1,136 +1,402 @@
 #include "TrieInterface.h"
+#include "BoundedQueue.h"
 #include "Trie.h"
 
 #include <fstream>
 #include <filesystem>
-#include <sstream>
+#include <functional>
 #include <iostream>
 #include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
 
 namespace fs = std::filesystem;
 
-static void WriteResults(const std::string& outPath, const std::unordered_map<std::string, std::vector<AIRREntity>>& results) {
-    std::ofstream outFile(outPath);
-    if (!outFile.is_open()) {
-        std::cerr << "Error: Unable to write to " << outPath << std::endl;
-        return;
-    }
+static const size_t BATCH_SIZE = 1000;
+static const size_t PIPELINE_DEPTH = 4;
 
-    bool hasVGene = false, hasJGene = false;
+// Radius searches fill `matches`, indexed by query position, and with
+// --stats also `stats`; the join and top-k searches fill `results`, and
+// --count fills `counts`.
+struct QueryBatch {
+    std::vector<std::string> queries;
+    bool indexed = false;
+    Trie::BatchMatches matches;
+    std::vector<Trie::SearchStats> stats;
+    std::unordered_map<std::string, std::vector<AIRREntity>> results;
+    std::vector<uint64_t> counts;
+};
+
+static void DetectGeneColumns(const std::unordered_map<std::string, std::vector<AIRREntity>>& results,
+                              bool& hasVGene, bool& hasJGene) {
+    hasVGene = false;
+    hasJGene = false;
     for (const auto& [_, matches] : results) {
         for (const auto& m : matches) {
             if (!m.vGene.empty()) hasVGene = true;
             if (!m.jGene.empty()) hasJGene = true;
-            if (hasVGene && hasJGene) break;
+            if (hasVGene && hasJGene) return;
         }
-        if (hasVGene && hasJGene) break;
     }
+}
+
+static void DetectGeneColumns(const Trie& trie, const Trie::BatchMatches& matches, bool& hasVGene, bool& hasJGene) {
+    hasVGene = false;
+    hasJGene = false;
+    for (const auto& m : matches.matches) {
+        if (!trie.MatchVGene(m).empty()) hasVGene = true;
+        if (!trie.MatchJGene(m).empty()) hasJGene = true;
+        if (hasVGene && hasJGene) return;
+    }
+}
 
-    outFile << "query\tmatch\tdist";
-    if (hasVGene) outFile << "\tv_gene";
-    if (hasJGene) outFile << "\tj_gene";
-    outFile << '\n';
+static void WriteHeader(std::ostream& out, bool hasVGene, bool hasJGene) {
+    out << "query\tmatch\tdist";
+    if (hasVGene) out << "\tv_gene";
+    if (hasJGene) out << "\tj_gene";
+    out << '\n';
+}
 
+static void WriteMatches(std::ostream& out, const std::string& query, const std::vector<AIRREntity>& matches,
+                         bool hasVGene, bool hasJGene) {
+    for (const auto& match : matches) {
+        out << query << '\t' << match.junctionAA << '\t' << match.distance;
+        if (hasVGene) out << '\t' << match.vGene;
+        if (hasJGene) out << '\t' << match.jGene;
+        out << '\n';
+    }
+}
+
+static void WriteMatches(std::ostream& out, const Trie& trie, const std::string& query,
+                         const Trie::RecordMatch* begin, const Trie::RecordMatch* end,
+                         bool hasVGene, bool hasJGene) {
+    for (const Trie::RecordMatch* match = begin; match != end; ++match) {
+        out << query << '\t' << trie.MatchJunction(*match) << '\t' << match->distance;
+        if (hasVGene) out << '\t' << trie.MatchVGene(*match);
+        if (hasJGene) out << '\t' << trie.MatchJGene(*match);
+        out << '\n';
+    }
+}
+
+static void WriteStatsHeader(std::ostream& out) {
+    out << "query\tnodes_visited\tdp_cells\tpruned_genes\tpruned_length\tpruned_distance"
+           "\tterminal_hits\trejected_genes\tmatches\tprepare_us\ttraverse_us\texpand_us\n";
+}
+
+static void WriteStats(std::ostream& out, const std::string& query, const Trie::SearchStats& stats) {
+    out << query << '\t' << stats.nodesVisited << '\t' << stats.dpCells << '\t' << stats.prunedByGenes
+        << '\t' << stats.prunedByLength << '\t' << stats.prunedByDistance << '\t' << stats.terminalHits
+        << '\t' << stats.rejectedByGenes << '\t' << stats.matches << '\t' << stats.prepareUs
+        << '\t' << stats.traverseUs << '\t' << stats.expandUs << '\n';
+}
+
+// Aggregate of a --stats run: totals and means per searched query.
+static void PrintStatsSummary(const Trie::SearchStats& total, size_t queryCount, const std::string& statsPath) {
+    double n = std::max<size_t>(queryCount, 1);
+    std::cout << "Search stats for " << queryCount << " queries (total / mean per query):\n"
+              << "  nodes visited     " << total.nodesVisited << " / " << total.nodesVisited / n << '\n'
+              << "  DP cells          " << total.dpCells << " / " << total.dpCells / n << '\n'
+              << "  pruned by genes   " << total.prunedByGenes << " / " << total.prunedByGenes / n << '\n'
+              << "  pruned by length  " << total.prunedByLength << " / " << total.prunedByLength / n << '\n'
+              << "  pruned by dist.   " << total.prunedByDistance << " / " << total.prunedByDistance / n << '\n'
+              << "  terminal hits     " << total.terminalHits << " / " << total.terminalHits / n << '\n'
+              << "  rejected by genes " << total.rejectedByGenes << " / " << total.rejectedByGenes / n << '\n'
+              << "  matches           " << total.matches << " / " << total.matches / n << '\n'
+              << "  prepare us        " << total.prepareUs << " / " << total.prepareUs / n << '\n'
+              << "  traverse us       " << total.traverseUs << " / " << total.traverseUs / n << '\n'
+              << "  expand us         " << total.expandUs << " / " << total.expandUs / n << '\n'
+              << "Per-query stats saved to: " << statsPath << std::endl;
+}
+
+static void WriteResults(const std::string& outPath, const std::unordered_map<std::string, std::vector<AIRREntity>>& results) {
+    std::ofstream outFile(outPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Unable to write to " << outPath << std::endl;
+        return;
+    }
+
+    bool hasVGene, hasJGene;
+    DetectGeneColumns(results, hasVGene, hasJGene);
+    WriteHeader(outFile, hasVGene, hasJGene);
     for (const auto& [query, matches] : results) {
-        for (const auto& match : matches) {
-            outFile << query << '\t' << match.junctionAA << '\t' << match.distance;
-            if (hasVGene) outFile << '\t' << match.vGene;
-            if (hasJGene) outFile << '\t' << match.jGene;
-            outFile << '\n';
-        }
+        WriteMatches(outFile, query, matches, hasVGene, hasJGene);
     }
 }
 
-static std::vector<std::string> LoadQueriesFromFile(const std::string& path) {
+static void WriteCountsHeader(std::ostream& out) {
+    out << "query\tcount\n";
+}
+
+// Reader stage: streams the query file into batches of BATCH_SIZE queries.
+static void ReadQueryBatches(const std::string& path, BoundedQueue<QueryBatch>& parsed) {
     std::ifstream file(path);
-    std::vector<std::string> queries;
-    std::string line;
+    if (!file.is_open()) {
+        std::cerr << "Error: Unable to read " << path << std::endl;
+        parsed.Close();
+        return;
+    }
 
+    std::string line;
     std::getline(file, line);
 
+    QueryBatch batch;
     while (std::getline(file, line)) {
-        std::stringstream ss(line);
-        std::string field;
-        std::getline(ss, field, '\t');
-        if (!field.empty()) {
-            queries.push_back(field);
+        std::string field = line.substr(0, line.find('\t'));
+        if (field.empty()) continue;
+        batch.queries.push_back(std::move(field));
+        if (batch.queries.size() == BATCH_SIZE) {
+            if (!parsed.Push(std::move(batch))) return;
+            batch = QueryBatch();
         }
     }
-    return queries;
+    if (!batch.queries.empty()) {
+        parsed.Push(std::move(batch));
+    }
+    parsed.Close();
+}
+
+// Writer stage: formats searched batches in the order they arrive, i.e. the
+// input order of the batches. With keepOrder the matches of a batch follow
+// the order of its queries instead of the result map order. Indexed batches
+// are always written in query order; without keepOrder a repeated query is
+// written once, as with the map.
+// With statsOut, the statistics of every query are written to it in query
+// order. A query repeated within a batch shows the statistics of the search
+// it shares, but only that search is added to statsTotal and statsQueries.
+static void WriteResultBatches(const Trie& trie, const std::string& outPath, bool keepOrder,
+                               std::ostream* statsOut, Trie::SearchStats& statsTotal,
+                               size_t& statsQueries, BoundedQueue<QueryBatch>& searched) {
+    std::ofstream outFile(outPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Unable to write to " << outPath << std::endl;
+        searched.Close();
+        return;
+    }
+
+    bool firstBatch = true;
+    bool hasVGene = false, hasJGene = false;
+    QueryBatch batch;
+    while (searched.Pop(batch)) {
+        if (firstBatch) {
+            if (batch.indexed) {
+                DetectGeneColumns(trie, batch.matches, hasVGene, hasJGene);
+            } else {
+                DetectGeneColumns(batch.results, hasVGene, hasJGene);
+            }
+            WriteHeader(outFile, hasVGene, hasJGene);
+            firstBatch = false;
+        }
+        if (statsOut) {
+            std::unordered_set<std::string_view> searchedQueries;
+            for (size_t i = 0; i < batch.stats.size(); ++i) {
+                WriteStats(*statsOut, batch.queries[i], batch.stats[i]);
+                if (searchedQueries.insert(batch.queries[i]).second) {
+                    statsTotal.Add(batch.stats[i]);
+                    ++statsQueries;
+                }
+            }
+        }
+        if (batch.indexed) {
+            std::unordered_set<std::string_view> written;
+            for (size_t i = 0; i < batch.queries.size(); ++i) {
+                if (!keepOrder && !written.insert(batch.queries[i]).second) continue;
+                auto [begin, end] = batch.matches.ForQuery(i);
+                WriteMatches(outFile, trie, batch.queries[i], begin, end, hasVGene, hasJGene);
+            }
+        } else if (keepOrder) {
+            for (const auto& query : batch.queries) {
+                WriteMatches(outFile, query, batch.results[query], hasVGene, hasJGene);
+            }
+        } else {
+            for (const auto& [query, matches] : batch.results) {
+                WriteMatches(outFile, query, matches, hasVGene, hasJGene);
+            }
+        }
+    }
+    if (firstBatch) {
+        WriteHeader(outFile, false, false);
+    }
+}
+
+// Writer stage of --count: one row per query, in input order.
+static void WriteCountBatches(const std::string& outPath, BoundedQueue<QueryBatch>& searched) {
+    std::ofstream outFile(outPath);
+    if (!outFile.is_open()) {
+        std::cerr << "Error: Unable to write to " << outPath << std::endl;
+        searched.Close();
+        return;
+    }
+
+    WriteCountsHeader(outFile);
+    QueryBatch batch;
+    while (searched.Pop(batch)) {
+        for (size_t i = 0; i < batch.queries.size(); ++i) {
+            outFile << batch.queries[i] << '\t' << batch.counts[i] << '\n';
+        }
+    }
+}
+
+// Runs the batch search as a reader -> searcher -> writer pipeline connected by
+// bounded queues, so parsing, searching and output overlap and memory stays
+// bounded by PIPELINE_DEPTH batches whatever the size of the query file.
+static void RunBatchPipeline(Trie& trie, const SearchConfig& config, const std::string& outFilePath) {
+    std::ofstream statsFile;
+    if (!config.statsPath.empty()) {
+        statsFile.open(config.statsPath);
+        if (!statsFile.is_open()) {
+            throw std::runtime_error("Unable to write to " + config.statsPath);
+        }
+        WriteStatsHeader(statsFile);
+    }
+    Trie::SearchStats statsTotal;
+    size_t statsQueries = 0;
+
+    BoundedQueue<QueryBatch> parsed(PIPELINE_DEPTH);
+    BoundedQueue<QueryBatch> searched(PIPELINE_DEPTH);
+
+    std::thread reader(ReadQueryBatches, std::cref(config.inputQueries), std::ref(parsed));
+    std::thread writer = config.countOnly
+            ? std::thread(WriteCountBatches, std::cref(outFilePath), std::ref(searched))
+            : std::thread(WriteResultBatches, std::cref(trie), std::cref(outFilePath), config.keepOrder,
+                          statsFile.is_open() ? &statsFile : nullptr, std::ref(statsTotal),
+                          std::ref(statsQueries), std::ref(searched));
+
+    try {
+        QueryBatch batch;
+        while (parsed.Pop(batch)) {
+            std::vector<Trie::SearchStats>* stats = statsFile.is_open() ? &batch.stats : nullptr;
+            if (config.countOnly && !config.matrixPath.empty()) {
+                batch.counts = trie.CountForAllWithMatrix(batch.queries, config.costRadius);
+            } else if (config.countOnly) {
+                batch.counts = trie.CountForAll(batch.queries, config.maxSubstitution, config.maxInsertion,
+                                                config.maxDeletion);
+            } else if (config.topK > 0 && !config.matrixPath.empty()) {
+                batch.results = trie.SearchNearestForAllWithMatrix(batch.queries, config.topK);
+            } else if (config.topK > 0) {
+                batch.results = trie.SearchNearestForAll(batch.queries, config.topK);
+            } else if (!config.matrixPath.empty() && config.useJoin) {
+                batch.results = trie.JoinForAllWithMatrix(batch.queries, config.costRadius);
+            } else if (!config.matrixPath.empty()) {
+                batch.matches = trie.SearchForAllWithMatrixIndexed(batch.queries, config.costRadius,
+                                                                   std::nullopt, std::nullopt, stats);
+                batch.indexed = true;
+            } else if (config.useJoin) {
+                batch.results = trie.JoinForAll(batch.queries, config.maxSubstitution, config.maxInsertion, config.maxDeletion);
+            } else {
+                batch.matches = trie.SearchForAllIndexed(batch.queries, config.maxSubstitution, config.maxInsertion,
+                                                         config.maxDeletion, std::nullopt, std::nullopt, stats);
+                batch.indexed = true;
+            }
+            if (!searched.Push(std::move(batch))) {
+                parsed.Close();
+                break;
+            }
+        }
+    } catch (...) {
+        parsed.Close();
+        searched.Close();
+        reader.join();
+        writer.join();
+        throw;
+    }
+
+    searched.Close();
+    reader.join();
+    writer.join();
+
+    if (statsFile.is_open()) {
+        PrintStatsSummary(statsTotal, statsQueries, config.statsPath);
+    }
 }
 
 void RunSearch(const SearchConfig& config) {
-    Trie trie(config.inputPath);
+    Trie trie;
+    if (!config.loadIndexPath.empty()) {
+        if (!trie.LoadIndex(config.loadIndexPath)) {
+            throw std::runtime_error("Unable to load index " + config.loadIndexPath);
+        }
+    } else {
+        trie = Trie(config.inputPath);
+    }
+
+    if (!config.saveIndexPath.empty()) {
+        if (!trie.SaveIndex(config.saveIndexPath)) {
+            throw std::runtime_error("Unable to save index " + config.saveIndexPath);
+        }
+        std::cout << "Index saved to: " << config.saveIndexPath << std::endl;
+        if (config.query.empty() && config.inputQueries.empty() && config.selfJoinPath.empty()) {
+            return;
+        }
+    }
+
+    if (!config.selfJoinPath.empty()) {
+        std::vector<Trie::NeighborEdge> edges = trie.SelfJoin(config.maxSubstitution, config.maxInsertion);
+        if (!Trie::SaveNeighborEdges(edges, config.selfJoinPath)) {
+            throw std::runtime_error("Unable to write edge list " + config.selfJoinPath);
+        }
+        std::cout << "Self-join found " << edges.size() << " pairs. Edges saved to: " << config.selfJoinPath << std::endl;
+        return;
+    }
 
     trie.SetDeletionScore(config.deletionScore);
     if (!config.matrixPath.empty()) {
         trie.LoadSubstitutionMatrix(config.matrixPath);
     }
+    trie.SetResultCacheSize(config.resultCacheSize);
 
     fs::create_directories(config.outputPath);
-    std::string outFilePath = config.outputPath + "/results.tsv";
+    std::string outFilePath = config.outputPath + (config.countOnly ? "/counts.tsv" : "/results.tsv");
+
+    if (!config.query.empty() && config.countOnly) {
+        std::optional<std::string> vGene, jGene;
+        if (!config.vGene.empty()) vGene = config.vGene;
+        if (!config.jGene.empty()) jGene = config.jGene;
+
+        uint64_t count = config.matrixPath.empty()
+                ? trie.Count(config.query, config.maxSubstitution, config.maxInsertion, config.maxDeletion,
+                             vGene, jGene)
+                : trie.CountWithMatrix(config.query, config.costRadius, vGene, jGene);
+        std::ofstream outFile(outFilePath);
+        if (!outFile.is_open()) {
+            throw std::runtime_error("Unable to write to " + outFilePath);
+        }
+        WriteCountsHeader(outFile);
+        outFile << config.query << '\t' << count << '\n';
+    }
+    else if (!config.query.empty()) {
+        std::optional<std::string> vGene, jGene;
+        if (!config.vGene.empty()) vGene = config.vGene;
+        if (!config.jGene.empty()) jGene = config.jGene;
 
-    if (!config.query.empty()) {
         std::vector<AIRREntity> results;
-        if (!config.matrixPath.empty()) {
-            results = trie.SearchWithMatrix(config.query, config.costRadius);
+        Trie::SearchStats stats;
+        Trie::SearchStats* statsOut = config.statsPath.empty() ? nullptr : &stats;
+        if (config.topK > 0 && !config.matrixPath.empty()) {
+            results = trie.SearchNearestWithMatrix(config.query, config.topK, vGene, jGene);
+        } else if (config.topK > 0) {
+            results = trie.SearchNearest(config.query, config.topK, vGene, jGene);
+        } else if (!config.matrixPath.empty()) {
+            results = trie.SearchWithMatrix(config.query, config.costRadius, vGene, jGene, statsOut);
         } else {
-            results = trie.SearchAIRR(config.query, config.maxSubstitution, config.maxInsertion, config.maxDeletion);
+            results = trie.SearchAIRR(config.query, config.maxSubstitution, config.maxInsertion, config.maxDeletion,
+                                      vGene, jGene, statsOut);
+        }
+        if (statsOut) {
+            std::ofstream statsFile(config.statsPath);
+            if (!statsFile.is_open()) {
+                throw std::runtime_error("Unable to write to " + config.statsPath);
+            }
+            WriteStatsHeader(statsFile);
+            WriteStats(statsFile, config.query, stats);
+            PrintStatsSummary(stats, 1, config.statsPath);
         }
         std::unordered_map<std::string, std::vector<AIRREntity>> wrapped{{config.query, results}};
         WriteResults(outFilePath, wrapped);
     }
     else if (!config.inputQueries.empty()) {
-        auto queries = LoadQueriesFromFile(config.inputQueries);
-        const size_t BATCH_SIZE = 1000;
-        bool firstBatch = true;
-
-        for (size_t start = 0; start < queries.size(); start += BATCH_SIZE) {
-            size_t end = std::min(queries.size(), start + BATCH_SIZE);
-            std::vector<std::string> batchQueries(queries.begin() + start, queries.begin() + end);
-
-            std::unordered_map<std::string, std::vector<AIRREntity>> batchResults;
-            if (!config.matrixPath.empty()) {
-                batchResults = trie.SearchForAllWithMatrix(batchQueries, config.costRadius);
-            } else {
-                batchResults = trie.SearchForAll(batchQueries, config.maxSubstitution, config.maxInsertion, config.maxDeletion);
-            }
-
-            std::ofstream outFile(outFilePath, firstBatch ? std::ios::out : std::ios::out | std::ios::app);
-            if (!outFile.is_open()) {
-                std::cerr << "Error: Unable to write to " << outFilePath << std::endl;
-                return;
-            }
-
-            if (firstBatch) {
-                bool hasVGene = false, hasJGene = false;
-                for (const auto& [_, matches] : batchResults) {
-                    for (const auto& m : matches) {
-                        if (!m.vGene.empty()) hasVGene = true;
-                        if (!m.jGene.empty()) hasJGene = true;
-                        if (hasVGene && hasJGene) break;
-                    }
-                    if (hasVGene && hasJGene) break;
-                }
-                outFile << "query\tmatch\tdist";
-                if (hasVGene) outFile << "\tv_gene";
-                if (hasJGene) outFile << "\tj_gene";
-                outFile << '\n';
-            }
-
-            for (const auto& [query, matches] : batchResults) {
-                for (const auto& m : matches) {
-                    outFile << query << '\t'
-                            << m.junctionAA << '\t'
-                            << m.distance;
-                    if (!m.vGene.empty()) outFile << '\t' << m.vGene;
-                    if (!m.jGene.empty()) outFile << '\t' << m.jGene;
-                    outFile << '\n';
-                }
-            }
-
-            firstBatch = false;
-        }
+        RunBatchPipeline(trie, config, outFilePath);
     }
     else {
         std::cerr << "Error: No query provided.\n";
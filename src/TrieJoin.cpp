@@ -0,0 +1,591 @@
+#include "Trie.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+// Trie-vs-trie join. The queries of a chunk are put in a trie of their own,
+// and the repertoire trie is walked once against it. The DP row of a
+// repertoire node then has one cell per query-trie node (the column of the
+// query prefix ending there) instead of one row per query, so a prefix
+// shared by many queries is aligned once. Only the cells within the budget
+// are kept, as a list of active query nodes per repertoire depth; a
+// repertoire subtree is cut when that list runs empty. What happens to a
+// match is up to a sink, which can also rule out query nodes up front.
+
+// Unit-cost search with separate substitution/insertion/deletion budgets,
+// cell layout as in SearchRecursiveAIRR: slot d holds the fewest
+// substitutions of an alignment with d deletions.
+struct Trie::EditJoinKernel {
+    using Value = int;
+
+    EditBudget budget;
+
+    int Width() const { return budget.deletions + 1; }
+
+    bool Origin(Value* cell) const {
+        std::fill(cell, cell + Width(), kUnreachable);
+        cell[0] = 0;
+        return true;
+    }
+
+    // up, diag and left are the cells of (trie depth - 1, same query node),
+    // (trie depth - 1, parent query node) and (trie depth, parent query
+    // node), or nullptr when they are not active.
+    bool Step(Value* cell, const Value* up, const Value* diag, const Value* left,
+              int trieLetter, int queryLetter, int depth, int queryDepth,
+              const LengthRange& keys, const LengthRange& queries) const {
+        // Every finished alignment below has (key length - query length)
+        // within [keys.min - queries.max, keys.max - queries.min].
+        const int64_t minGap = static_cast<int64_t>(keys.minLength) - queries.maxLength;
+        const int64_t maxGap = static_cast<int64_t>(keys.maxLength) - queries.minLength;
+        bool reachable = false;
+        for (int d = 0; d < Width(); ++d) {
+            int insertions = d + depth - queryDepth;
+            if (insertions < 0 || insertions > budget.insertions
+                || maxGap < depth - queryDepth - budget.deletions + d
+                || minGap > budget.insertions - d) {
+                cell[d] = kUnreachable;
+                continue;
+            }
+            int best = kUnreachable;
+            if (up) best = up[d];
+            if (diag) best = std::min(best, diag[d] + (queryLetter == trieLetter ? 0 : 1));
+            if (left && d > 0) best = std::min(best, left[d - 1]);
+            if (best > budget.substitutions) {
+                best = kUnreachable;
+            } else {
+                reachable = true;
+            }
+            cell[d] = best;
+        }
+        return reachable;
+    }
+
+    bool Distance(const Value* cell, int depth, int queryDepth, double& distance) const {
+        int best = kUnreachable;
+        for (int d = 0; d < Width(); ++d) {
+            if (cell[d] != kUnreachable) {
+                best = std::min(best, cell[d] + 2 * d + depth - queryDepth);
+            }
+        }
+        distance = best;
+        return best != kUnreachable;
+    }
+};
+
+// Substitution-matrix search, one cost per cell as in SearchRecursiveCost.
+struct Trie::CostJoinKernel {
+    using Value = float;
+
+    const float* costTable;
+    float maxCost;
+    float minGapCost;
+
+    int Width() const { return 1; }
+
+    bool Origin(Value* cell) const {
+        cell[0] = 0;
+        return true;
+    }
+
+    bool Step(Value* cell, const Value* up, const Value* diag, const Value* left,
+              int trieLetter, int queryLetter, int depth, int queryDepth,
+              const LengthRange& keys, const LengthRange& queries) const {
+        const float* gapCosts = costTable + kGapCode * kCostTableStride;
+        float best = kUnreachable;
+        if (up) best = up[0] + gapCosts[trieLetter];
+        if (diag) best = std::min(best, diag[0] + costTable[queryLetter * kCostTableStride + trieLetter]);
+        if (left) best = std::min(best, left[0] + gapCosts[queryLetter]);
+        cell[0] = best;
+
+        // Any length difference left has to be paid with gaps.
+        const int64_t minKeyLeft = static_cast<int64_t>(keys.minLength) - depth;
+        const int64_t maxKeyLeft = static_cast<int64_t>(keys.maxLength) - depth;
+        const int64_t minQueryLeft = static_cast<int64_t>(queries.minLength) - queryDepth;
+        const int64_t maxQueryLeft = static_cast<int64_t>(queries.maxLength) - queryDepth;
+        float gapCost = 0;
+        if (minKeyLeft > maxQueryLeft) {
+            gapCost = (minKeyLeft - maxQueryLeft) * minGapCost;
+        } else if (minQueryLeft > maxKeyLeft) {
+            gapCost = (minQueryLeft - maxKeyLeft) * minGapCost;
+        }
+        return best + gapCost <= maxCost;
+    }
+
+    bool Distance(const Value* cell, int, int, double& distance) const {
+        distance = cell[0];
+        return cell[0] <= maxCost;
+    }
+};
+
+// Collects the matches of every query clonotype, as the per-query search
+// would.
+struct Trie::JoinMatchSink {
+    const Trie& repertoire;
+    const Trie& queries;
+    const GeneFilter& filter;
+    std::vector<std::vector<ClonotypeMatch>> matches;
+
+    JoinMatchSink(const Trie& repertoire, const Trie& queries, const GeneFilter& filter)
+            : repertoire(repertoire), queries(queries), filter(filter), matches(queries.ClonotypeCount()) {}
+
+    bool Admits(uint32_t, uint32_t) const { return true; }
+
+    void Emit(uint32_t repNode, uint32_t queryNode, double distance) {
+        const TrieNode& node = queries.nodes_[queryNode];
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            repertoire.CollectClonotypes(repNode, distance, filter, matches[queries.terminalIndices_[k]]);
+        }
+    }
+};
+
+template <typename Kernel, typename Sink>
+struct Trie::JoinTraversal {
+    using Value = typename Kernel::Value;
+
+    const Trie& repertoire;
+    const Trie& queries;
+    const Kernel& kernel;
+    const GeneFilter& filter;
+    Sink& sink;
+    const int width;
+
+    // Parent, letter code and depth of every query-trie node.
+    std::vector<uint32_t> parent;
+    std::vector<int> letter;
+    std::vector<int> queryDepth;
+
+    // Active query nodes and their cells per repertoire depth. The rows on
+    // the current path are kept; the slot maps locate a query node's cell in
+    // the previous and the current row, and are valid while their stamp
+    // equals the token they were filled with.
+    std::vector<std::vector<uint32_t>> active;
+    std::vector<std::vector<Value>> values;
+    std::vector<uint32_t> previousSlot;
+    std::vector<uint32_t> previousStamp;
+    std::vector<uint32_t> rowSlot;
+    std::vector<uint32_t> rowStamp;
+    std::vector<uint32_t> queued;
+    std::vector<std::vector<uint32_t>> pending;
+    std::vector<Value> scratch;
+    uint32_t token = 0;
+
+    JoinTraversal(const Trie& repertoire, const Trie& queries, const Kernel& kernel, const GeneFilter& filter,
+                  Sink& sink)
+            : repertoire(repertoire), queries(queries), kernel(kernel), filter(filter), sink(sink),
+              width(kernel.Width()),
+              parent(queries.nodes_.size(), 0), letter(queries.nodes_.size(), -1),
+              queryDepth(queries.nodes_.size(), 0),
+              active(repertoire.maxDepth_ + 1), values(repertoire.maxDepth_ + 1),
+              previousSlot(queries.nodes_.size()), previousStamp(queries.nodes_.size(), 0),
+              rowSlot(queries.nodes_.size()), rowStamp(queries.nodes_.size(), 0),
+              queued(queries.nodes_.size(), 0),
+              pending(queries.maxDepth_ + 1),
+              scratch(width) {
+        for (uint32_t q = 0; q < queries.nodes_.size(); ++q) {
+            const TrieNode& node = queries.nodes_[q];
+            uint32_t child = node.firstChild;
+            for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+                parent[child] = q;
+                letter[child] = __builtin_ctz(mask);
+                queryDepth[child] = queryDepth[q] + 1;
+            }
+        }
+    }
+
+    void Enqueue(uint32_t q) {
+        if (queued[q] == token) return;
+        queued[q] = token;
+        pending[queryDepth[q]].push_back(q);
+    }
+
+    void EnqueueChildren(uint32_t q) {
+        const TrieNode& node = queries.nodes_[q];
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            Enqueue(child);
+        }
+    }
+
+    // Computes the active cells of the row of repertoire node repNode at
+    // `depth`, reached with trieLetter, from the row at depth - 1. Query
+    // nodes are processed by query depth, so every parent is done before
+    // its children.
+    bool ComputeRow(int depth, int trieLetter, uint32_t repNode) {
+        const uint32_t previousToken = ++token;
+        if (depth > 0) {
+            const std::vector<uint32_t>& previous = active[depth - 1];
+            for (uint32_t i = 0; i < previous.size(); ++i) {
+                previousSlot[previous[i]] = i;
+                previousStamp[previous[i]] = previousToken;
+            }
+        }
+        const uint32_t currentToken = ++token;
+        std::vector<uint32_t>& row = active[depth];
+        std::vector<Value>& rowValues = values[depth];
+        row.clear();
+        rowValues.clear();
+        if (depth == 0) {
+            Enqueue(0);
+        } else {
+            for (uint32_t q : active[depth - 1]) {
+                Enqueue(q);
+                EnqueueChildren(q);
+            }
+        }
+
+        const Value* previousValues = depth > 0 ? values[depth - 1].data() : nullptr;
+        auto previousCell = [&](uint32_t q) -> const Value* {
+            return previousStamp[q] == previousToken ? previousValues + previousSlot[q] * width : nullptr;
+        };
+        auto rowCell = [&](uint32_t q) -> const Value* {
+            return rowStamp[q] == currentToken ? rowValues.data() + rowSlot[q] * width : nullptr;
+        };
+
+        const LengthRange& keys = repertoire.lengthRanges_[repNode];
+        for (size_t queryLevel = 0; queryLevel < pending.size(); ++queryLevel) {
+            // EnqueueChildren only appends to the next level.
+            for (size_t i = 0; i < pending[queryLevel].size(); ++i) {
+                uint32_t q = pending[queryLevel][i];
+                if (!sink.Admits(repNode, q)) continue;
+                Value* cell = scratch.data();
+                bool isActive;
+                if (depth == 0 && q == 0) {
+                    isActive = kernel.Origin(cell);
+                } else {
+                    const Value* up = depth > 0 ? previousCell(q) : nullptr;
+                    const Value* diag = depth > 0 && q != 0 ? previousCell(parent[q]) : nullptr;
+                    const Value* left = q != 0 ? rowCell(parent[q]) : nullptr;
+                    isActive = (up || diag || left)
+                               && kernel.Step(cell, up, diag, left, trieLetter, letter[q], depth, queryDepth[q],
+                                              keys, queries.lengthRanges_[q]);
+                }
+                if (!isActive) continue;
+
+                rowSlot[q] = row.size();
+                rowStamp[q] = currentToken;
+                row.push_back(q);
+                rowValues.insert(rowValues.end(), cell, cell + width);
+                EnqueueChildren(q);
+            }
+            pending[queryLevel].clear();
+        }
+        return !row.empty();
+    }
+
+    void EmitTerminals(uint32_t repNode, int depth) {
+        const TrieNode& node = repertoire.nodes_[repNode];
+        if (node.indicesBegin == node.indicesEnd) return;
+        const std::vector<uint32_t>& row = active[depth];
+        for (size_t i = 0; i < row.size(); ++i) {
+            const TrieNode& queryNode = queries.nodes_[row[i]];
+            if (queryNode.indicesBegin == queryNode.indicesEnd) continue;
+            double distance;
+            if (kernel.Distance(values[depth].data() + i * width, depth, queryDepth[row[i]], distance)) {
+                sink.Emit(repNode, row[i], distance);
+            }
+        }
+    }
+
+    // Visits the subtree of repNode, whose row at `depth` is computed.
+    void Visit(uint32_t repNode, int depth) {
+        EmitTerminals(repNode, depth);
+
+        const TrieNode& node = repertoire.nodes_[repNode];
+        uint32_t child = node.firstChild;
+        for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+            if (!repertoire.SubtreeMayMatch(child, filter)) continue;
+            if (ComputeRow(depth + 1, __builtin_ctz(mask), child)) {
+                Visit(child, depth + 1);
+            }
+        }
+    }
+};
+
+// Self-join sink. Both sides are the same trie, and a pair is reported
+// from the side whose terminal position (in terminalIndices_) is the
+// smaller one. A query node is ruled out once none of its terminals comes
+// before the last terminal below the repertoire node; that only gets truer
+// further down on either side.
+struct Trie::SelfJoinSink {
+    const Trie& trie;
+    const std::vector<uint32_t>& terminalEnds;
+    std::vector<NeighborEdge> edges;
+
+    bool Admits(uint32_t repNode, uint32_t queryNode) const {
+        return trie.nodes_[queryNode].indicesBegin + 1 < terminalEnds[repNode];
+    }
+
+    void Emit(uint32_t repNode, uint32_t queryNode, double distance) {
+        const TrieNode& node = trie.nodes_[repNode];
+        const TrieNode& queryTerminals = trie.nodes_[queryNode];
+        for (uint32_t kq = queryTerminals.indicesBegin; kq < queryTerminals.indicesEnd; ++kq) {
+            for (uint32_t kr = std::max(kq + 1, node.indicesBegin); kr < node.indicesEnd; ++kr) {
+                uint32_t a = trie.terminalIndices_[kq];
+                uint32_t b = trie.terminalIndices_[kr];
+                edges.push_back({ std::min(a, b), std::max(a, b), static_cast<uint32_t>(distance) });
+            }
+        }
+    }
+};
+
+static const size_t MIN_JOIN_CHUNK = 256;
+
+template <typename Kernel, typename SearchFn>
+std::unordered_map<std::string, std::vector<AIRREntity>> Trie::RunJoin(const std::vector<std::string>& queries,
+                                                                       const Kernel& kernel,
+                                                                       const GeneFilter& filter,
+                                                                       SearchFn searchOne) {
+    // Queries the query trie cannot represent exactly (letters outside
+    // 'A'..'Z' are dropped from trie keys) or that are too long take the
+    // per-query path.
+    std::vector<std::string> joined;
+    std::unordered_map<std::string, std::vector<AIRREntity>> result;
+    result.reserve(queries.size());
+    for (const auto& query : queries) {
+        bool letters = std::all_of(query.begin(), query.end(), [](char c) { return c >= 'A' && c <= 'Z'; });
+        if (letters && static_cast<int>(query.size()) <= maxQueryLength_) {
+            joined.push_back(query);
+        } else if (!result.count(query)) {
+            result[query] = searchOne(query);
+        }
+    }
+    std::sort(joined.begin(), joined.end());
+    joined.erase(std::unique(joined.begin(), joined.end()), joined.end());
+    if (joined.empty()) return result;
+
+    // Contiguous runs of the sorted queries share the most prefixes, so each
+    // chunk gets one and builds its own query trie.
+    std::shared_ptr<ThreadPool> pool = Pool();
+    size_t chunks = std::clamp<size_t>(joined.size() / MIN_JOIN_CHUNK, 1, pool->ThreadCount());
+    size_t chunkSize = (joined.size() + chunks - 1) / chunks;
+    std::vector<std::vector<std::pair<std::string, std::vector<AIRREntity>>>> outputs(chunks);
+    pool->ParallelFor(chunks, 1, [&](size_t begin, size_t end, size_t) {
+        for (size_t c = begin; c < end; ++c) {
+            size_t first = c * chunkSize;
+            size_t last = std::min(joined.size(), first + chunkSize);
+            if (first >= last) continue;
+            Trie queryTrie(std::vector<std::string>(joined.begin() + first, joined.begin() + last));
+            JoinMatchSink sink(*this, queryTrie, filter);
+            JoinTraversal<Kernel, JoinMatchSink> traversal(*this, queryTrie, kernel, filter, sink);
+            if (traversal.ComputeRow(0, -1, root_)) {
+                traversal.Visit(root_, 0);
+            }
+            for (uint32_t q = 0; q < queryTrie.ClonotypeCount(); ++q) {
+                outputs[c].emplace_back(std::string(queryTrie.ClonotypeJunction(q)),
+                                        ExpandRecords(sink.matches[q], filter));
+            }
+        }
+    });
+
+    for (auto& output : outputs) {
+        for (auto& [query, matches] : output) {
+            result[query] = std::move(matches);
+        }
+    }
+    return result;
+}
+
+std::unordered_map<std::string, std::vector<AIRREntity>> Trie::JoinForAll(
+        const std::vector<std::string>& queries,
+        int maxSubstitution,
+        int maxInsertion,
+        int maxDeletion,
+        const std::optional<std::string>& vGeneFilter,
+        const std::optional<std::string>& jGeneFilter) {
+    GeneFilter filter;
+    if (maxSubstitution < 0 || maxInsertion < 0 || maxDeletion < 0
+        || !ResolveGeneFilter(vGeneFilter, jGeneFilter, filter) || !SubtreeMayMatch(root_, filter)) {
+        return SearchForAll(queries, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter);
+    }
+
+    EditJoinKernel kernel{ { maxSubstitution, maxInsertion, maxDeletion } };
+    return RunJoin(queries, kernel, filter, [&](const std::string& query) {
+        return SearchAIRR(query, maxSubstitution, maxInsertion, maxDeletion, vGeneFilter, jGeneFilter);
+    });
+}
+
+std::unordered_map<std::string, std::vector<AIRREntity>> Trie::JoinForAllWithMatrix(
+        const std::vector<std::string>& queries,
+        float maxCost,
+        const std::optional<std::string>& vGeneFilter,
+        const std::optional<std::string>& jGeneFilter) {
+    GeneFilter filter;
+    if (!useSubstitutionMatrix_
+        || !ResolveGeneFilter(vGeneFilter, jGeneFilter, filter) || !SubtreeMayMatch(root_, filter)) {
+        return SearchForAllWithMatrix(queries, maxCost, vGeneFilter, jGeneFilter);
+    }
+
+    const float* gapCosts = costTable_.data() + kGapCode * kCostTableStride;
+    float minGapCost = std::max(0.0f, *std::min_element(gapCosts, gapCosts + kGapCode));
+    CostJoinKernel kernel{ costTable_.data(), maxCost, minGapCost };
+    return RunJoin(queries, kernel, filter, [&](const std::string& query) {
+        return SearchWithMatrix(query, maxCost, vGeneFilter, jGeneFilter);
+    });
+}
+
+std::vector<Trie::NeighborEdge> Trie::SelfJoin(int maxSubstitution, int maxIndel) {
+    std::vector<NeighborEdge> edges;
+    if (maxSubstitution < 0 || maxIndel < 0) {
+        return edges;
+    }
+    // The work split below needs each subtree's terminals in one run.
+    Compact();
+
+    // End of each subtree's run of terminals; children come after their
+    // parent, so a reverse sweep sees them first.
+    std::vector<uint32_t> terminalEnds(nodes_.size());
+    for (size_t n = nodes_.size(); n-- > 0; ) {
+        const TrieNode& node = nodes_[n];
+        uint32_t end = node.indicesEnd;
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            end = std::max(end, terminalEnds[child]);
+        }
+        terminalEnds[n] = end;
+    }
+
+    // Split the trie into work units level by level until there are enough
+    // to keep the pool busy. A unit either owns a whole subtree or only the
+    // terminals of a node whose children became units of their own.
+    struct JoinUnit {
+        uint32_t node;
+        int depth;
+        bool descend;
+    };
+    std::shared_ptr<ThreadPool> pool = Pool();
+    const size_t targetUnits = pool->ThreadCount() * 16;
+    std::vector<JoinUnit> units{ { 0, 0, true } };
+    for (bool expanded = true; expanded && units.size() < targetUnits; ) {
+        expanded = false;
+        std::vector<JoinUnit> next;
+        for (const JoinUnit& unit : units) {
+            const TrieNode& node = nodes_[unit.node];
+            if (!unit.descend || node.childMask == 0) {
+                next.push_back({ unit.node, unit.depth, false });
+                continue;
+            }
+            if (node.indicesBegin != node.indicesEnd) {
+                next.push_back({ unit.node, unit.depth, false });
+            }
+            uint32_t childCount = __builtin_popcount(node.childMask);
+            for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+                next.push_back({ child, unit.depth + 1, true });
+            }
+            expanded = true;
+        }
+        units = std::move(next);
+    }
+
+    EditJoinKernel kernel{ { maxSubstitution, maxIndel, maxIndel } };
+    GeneFilter filter;
+    using SelfTraversal = JoinTraversal<EditJoinKernel, SelfJoinSink>;
+    std::vector<std::unique_ptr<SelfJoinSink>> sinks(pool->ThreadCount());
+    std::vector<std::unique_ptr<SelfTraversal>> traversals(pool->ThreadCount());
+    pool->ParallelFor(units.size(), 1, [&](size_t begin, size_t end, size_t worker) {
+        if (!traversals[worker]) {
+            sinks[worker] = std::make_unique<SelfJoinSink>(SelfJoinSink{ *this, terminalEnds, {} });
+            traversals[worker] = std::make_unique<SelfTraversal>(*this, *this, kernel, filter, *sinks[worker]);
+        }
+        SelfTraversal& traversal = *traversals[worker];
+        std::vector<uint32_t> path;
+        for (size_t u = begin; u < end; ++u) {
+            const JoinUnit& unit = units[u];
+            // Rows along the path down to the unit; both sides being the same
+            // trie, the query-side parents and letters describe it.
+            path.clear();
+            for (uint32_t n = unit.node; n != 0; n = traversal.parent[n]) {
+                path.push_back(n);
+            }
+            std::reverse(path.begin(), path.end());
+            bool reachable = traversal.ComputeRow(0, -1, 0);
+            for (size_t i = 0; reachable && i < path.size(); ++i) {
+                reachable = traversal.ComputeRow(i + 1, traversal.letter[path[i]], path[i]);
+            }
+            if (!reachable) continue;
+
+            if (unit.descend) {
+                traversal.Visit(unit.node, unit.depth);
+            } else {
+                traversal.EmitTerminals(unit.node, unit.depth);
+            }
+        }
+    });
+
+    for (const auto& sink : sinks) {
+        if (sink) {
+            edges.insert(edges.end(), sink->edges.begin(), sink->edges.end());
+        }
+    }
+    std::sort(edges.begin(), edges.end(), [](const NeighborEdge& a, const NeighborEdge& b) {
+        return a.first != b.first ? a.first < b.first : a.second < b.second;
+    });
+    return edges;
+}
+
+Trie::NeighborGraph Trie::SelfJoinGraph(int maxSubstitution, int maxIndel) {
+    std::vector<NeighborEdge> edges = SelfJoin(maxSubstitution, maxIndel);
+
+    NeighborGraph graph;
+    graph.offsets.assign(ClonotypeCount() + 1, 0);
+    for (const NeighborEdge& edge : edges) {
+        ++graph.offsets[edge.first + 1];
+        ++graph.offsets[edge.second + 1];
+    }
+    for (size_t c = 1; c < graph.offsets.size(); ++c) {
+        graph.offsets[c] += graph.offsets[c - 1];
+    }
+
+    // Edges are sorted by (first, second), so each adjacency list is filled
+    // in ascending order: the smaller neighbours arrive as `second`, before
+    // the larger ones arrive as `first`.
+    graph.neighbors.resize(edges.size() * 2);
+    graph.distances.resize(edges.size() * 2);
+    std::vector<uint64_t> fill(graph.offsets.begin(), graph.offsets.end() - 1);
+    for (const NeighborEdge& edge : edges) {
+        uint64_t slot = fill[edge.first]++;
+        graph.neighbors[slot] = edge.second;
+        graph.distances[slot] = edge.distance;
+        slot = fill[edge.second]++;
+        graph.neighbors[slot] = edge.first;
+        graph.distances[slot] = edge.distance;
+    }
+    return graph;
+}
+
+// Edge list layout (host byte order, checked through endianTag):
+//   EdgeListHeader, then edgeCount raw NeighborEdge records.
+static constexpr char kEdgeListMagic[8] = {'T', 'C', 'R', 'E', 'D', 'G', 'E', '\0'};
+static constexpr uint32_t kEdgeListVersion = 1;
+static constexpr uint32_t kEdgeListEndianTag = 0x01020304;
+
+struct EdgeListHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianTag;
+    uint64_t edgeCount;
+};
+
+bool Trie::SaveNeighborEdges(const std::vector<NeighborEdge>& edges, const std::string& path) {
+    EdgeListHeader header{};
+    std::memcpy(header.magic, kEdgeListMagic, sizeof(kEdgeListMagic));
+    header.version = kEdgeListVersion;
+    header.endianTag = kEdgeListEndianTag;
+    header.edgeCount = edges.size();
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        std::cerr << "Error: Unable to write edge list " << path << std::endl;
+        return false;
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(edges.data()), edges.size() * sizeof(NeighborEdge));
+    if (!out) {
+        std::cerr << "Error: Failed to write edge list " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,228 @@
+#include "Trie.h"
+
+#include <algorithm>
+#include <climits>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <queue>
+
+// Top-k search. Instead of a depth-first walk under a fixed radius, nodes
+// are expanded in order of a lower bound on the distance of any key below
+// them: the smallest DP cell plus the cheapest way to cover the length
+// difference to the keys of the subtree. Once k matches are held, the k-th
+// distance acts as the radius and shrinks as better matches come in; the
+// search ends when the best remaining bound cannot beat it.
+template <typename Value, typename StepFn, typename BoundFn>
+std::vector<Trie::ClonotypeMatch> Trie::SearchNearestBestFirst(size_t k, int queryLength, const Value* firstRow,
+                                                               const GeneFilter& filter, StepFn step, BoundFn bound) {
+    // The row of a frontier entry lives in `rows` at offset `row`. Rows of
+    // expanded or rejected entries go to `freeRows` for reuse, so `rows`
+    // holds about as many rows as the frontier at its largest.
+    struct Frontier {
+        Value bound;
+        uint32_t node;
+        int depth;
+        size_t row;
+    };
+    auto frontierOrder = [](const Frontier& a, const Frontier& b) { return a.bound > b.bound; };
+    std::priority_queue<Frontier, std::vector<Frontier>, decltype(frontierOrder)> frontier(frontierOrder);
+    auto matchOrder = [](const ClonotypeMatch& a, const ClonotypeMatch& b) { return a.distance < b.distance; };
+    std::priority_queue<ClonotypeMatch, std::vector<ClonotypeMatch>, decltype(matchOrder)> best(matchOrder);
+
+    // With k matches held, only strictly closer ones can get in.
+    auto beaten = [&](double distance) { return best.size() == k && distance >= best.top().distance; };
+
+    const size_t stride = queryLength + 1;
+    std::vector<Value> rows(firstRow, firstRow + stride);
+    std::vector<size_t> freeRows;
+    std::vector<ClonotypeMatch> found;
+    frontier.push({ bound(rows.data(), root_, 0), root_, 0, 0 });
+    while (!frontier.empty()) {
+        Frontier entry = frontier.top();
+        frontier.pop();
+        if (beaten(entry.bound)) break;
+
+        const TrieNode& node = nodes_[entry.node];
+        if (node.indicesBegin != node.indicesEnd) {
+            double distance = rows[entry.row + queryLength];
+            if (!beaten(distance)) {
+                found.clear();
+                CollectClonotypes(entry.node, distance, filter, found);
+                for (const auto& match : found) {
+                    if (best.size() < k) {
+                        best.push(match);
+                    } else if (match.distance < best.top().distance) {
+                        best.pop();
+                        best.push(match);
+                    }
+                }
+            }
+        }
+
+        uint32_t child = node.firstChild;
+        for (uint32_t mask = node.childMask; mask != 0; mask &= mask - 1, ++child) {
+            if (!SubtreeMayMatch(child, filter)) continue;
+            size_t offset;
+            if (freeRows.empty()) {
+                offset = rows.size();
+                rows.resize(offset + stride);
+            } else {
+                offset = freeRows.back();
+                freeRows.pop_back();
+            }
+            step(rows.data() + entry.row, rows.data() + offset, __builtin_ctz(mask), entry.depth + 1);
+            Value childBound = bound(rows.data() + offset, child, entry.depth + 1);
+            if (beaten(childBound)) {
+                freeRows.push_back(offset);
+                continue;
+            }
+            frontier.push({ childBound, child, entry.depth + 1, offset });
+        }
+        freeRows.push_back(entry.row);
+    }
+
+    std::vector<ClonotypeMatch> results;
+    results.reserve(best.size());
+    while (!best.empty()) {
+        results.push_back(best.top());
+        best.pop();
+    }
+    std::sort(results.begin(), results.end(), [](const ClonotypeMatch& a, const ClonotypeMatch& b) {
+        return a.distance != b.distance ? a.distance < b.distance : a.clonotype < b.clonotype;
+    });
+    return results;
+}
+
+// Letters of query still unaligned after cell j versus the letters left on
+// the keys below a node at `depth`: the difference, if any, has to be
+// covered with insertions or deletions.
+static void LengthGap(const Trie::LengthRange& lengths, int depth, int queryLeft,
+                      int64_t& deletions, int64_t& insertions) {
+    const int64_t minRemaining = static_cast<int64_t>(lengths.minLength) - depth;
+    const int64_t maxRemaining = static_cast<int64_t>(lengths.maxLength) - depth;
+    deletions = queryLeft < minRemaining ? minRemaining - queryLeft : 0;
+    insertions = queryLeft > maxRemaining ? queryLeft - maxRemaining : 0;
+}
+
+std::vector<Trie::ClonotypeMatch> Trie::SearchNearestClonotypes(const std::string& query, size_t k,
+                                                                const std::optional<std::string>& vGeneFilter,
+                                                                const std::optional<std::string>& jGeneFilter) {
+    GeneFilter filter;
+    if (k == 0 || !ResolveGeneFilter(vGeneFilter, jGeneFilter, filter) || !SubtreeMayMatch(root_, filter)) {
+        return {};
+    }
+
+    std::string key = ResultKey('n', { double(k) }, query, vGeneFilter, jGeneFilter);
+    if (auto cached = FindResult(key)) {
+        return *cached;
+    }
+
+    const int queryLength = query.size();
+    std::vector<int> firstRow(queryLength + 1);
+    std::iota(firstRow.begin(), firstRow.end(), 0);
+
+    auto step = [&](const int* row, int* next, int letterCode, int) {
+        char letter = 'A' + letterCode;
+        next[0] = row[0] + 1;
+        for (int j = 1; j <= queryLength; ++j) {
+            next[j] = std::min({ row[j] + 1, row[j - 1] + (query[j - 1] == letter ? 0 : 1), next[j - 1] + 1 });
+        }
+    };
+    auto bound = [&](const int* row, uint32_t node, int depth) {
+        int64_t lowerBound = INT_MAX;
+        for (int j = 0; j <= queryLength; ++j) {
+            int64_t deletions, insertions;
+            LengthGap(lengthRanges_[node], depth, queryLength - j, deletions, insertions);
+            lowerBound = std::min(lowerBound, row[j] + deletions + insertions);
+        }
+        return static_cast<int>(lowerBound);
+    };
+    std::vector<ClonotypeMatch> results = SearchNearestBestFirst<int>(k, queryLength, firstRow.data(), filter,
+                                                                      step, bound);
+    StoreResult(std::move(key), results);
+    return results;
+}
+
+std::vector<Trie::ClonotypeMatch> Trie::SearchNearestWithMatrixClonotypes(const std::string& query, size_t k,
+                                                                          const std::optional<std::string>& vGeneFilter,
+                                                                          const std::optional<std::string>& jGeneFilter) {
+    if (!useSubstitutionMatrix_) {
+        std::cerr << "No substitution matrix is entered, only Levenshtein distance search is available" << std::endl;
+        return {};
+    }
+
+    GeneFilter filter;
+    if (k == 0 || !ResolveGeneFilter(vGeneFilter, jGeneFilter, filter) || !SubtreeMayMatch(root_, filter)) {
+        return {};
+    }
+
+    std::string key = ResultKey('m', { double(k) }, query, vGeneFilter, jGeneFilter);
+    if (auto cached = FindResult(key)) {
+        return *cached;
+    }
+
+    // Profile layout and indel bounds as in SearchWithMatrixClonotypes.
+    const int queryLength = query.size();
+    const int stride = queryLength + 1;
+    const float* profile = BuildQueryProfile(query);
+    const float* insertionCosts = profile + kGapCode * stride;
+    std::vector<float> firstRow(stride, 0);
+    for (int j = 1; j <= queryLength; ++j) {
+        firstRow[j] = firstRow[j - 1] + insertionCosts[j];
+    }
+
+    IndelCosts indelCosts{ std::numeric_limits<float>::max(), std::numeric_limits<float>::max() };
+    for (int c = 0; c < kGapCode; ++c) {
+        indelCosts.deletion = std::min(indelCosts.deletion, profile[c * stride]);
+    }
+    for (int j = 1; j <= queryLength; ++j) {
+        indelCosts.insertion = std::min(indelCosts.insertion, insertionCosts[j]);
+    }
+    indelCosts.deletion = std::max(indelCosts.deletion, 0.0f);
+    indelCosts.insertion = std::max(indelCosts.insertion, 0.0f);
+
+    auto step = [&](const float* row, float* next, int letterCode, int) {
+        const float* letterCosts = profile + letterCode * stride;
+        float deletionCost = letterCosts[0];
+        next[0] = row[0] + deletionCost;
+        for (int j = 1; j <= queryLength; ++j) {
+            next[j] = std::min(row[j] + deletionCost, row[j - 1] + letterCosts[j]);
+        }
+        for (int j = 1; j <= queryLength; ++j) {
+            next[j] = std::min(next[j], next[j - 1] + insertionCosts[j]);
+        }
+    };
+    auto bound = [&](const float* row, uint32_t node, int depth) {
+        float lowerBound = std::numeric_limits<float>::max();
+        for (int j = 0; j <= queryLength; ++j) {
+            int64_t deletions, insertions;
+            LengthGap(lengthRanges_[node], depth, queryLength - j, deletions, insertions);
+            lowerBound = std::min(lowerBound, row[j] + deletions * indelCosts.deletion
+                                                     + insertions * indelCosts.insertion);
+        }
+        return lowerBound;
+    };
+    std::vector<ClonotypeMatch> results = SearchNearestBestFirst<float>(k, queryLength, firstRow.data(), filter,
+                                                                        step, bound);
+    StoreResult(std::move(key), results);
+    return results;
+}
+
+std::vector<AIRREntity> Trie::SearchNearest(const std::string& query, size_t k,
+                                            const std::optional<std::string>& vGeneFilter,
+                                            const std::optional<std::string>& jGeneFilter) {
+    std::vector<ClonotypeMatch> matches = SearchNearestClonotypes(query, k, vGeneFilter, jGeneFilter);
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    return ExpandRecords(matches, filter);
+}
+
+std::vector<AIRREntity> Trie::SearchNearestWithMatrix(const std::string& query, size_t k,
+                                                      const std::optional<std::string>& vGeneFilter,
+                                                      const std::optional<std::string>& jGeneFilter) {
+    std::vector<ClonotypeMatch> matches = SearchNearestWithMatrixClonotypes(query, k, vGeneFilter, jGeneFilter);
+    GeneFilter filter;
+    ResolveGeneFilter(vGeneFilter, jGeneFilter, filter);
+    return ExpandRecords(matches, filter);
+}
@@ -0,0 +1,741 @@
+#include "TrieServer.h"
+#include "BoundedQueue.h"
+#include "Trie.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+// Protocol: one request per line, with tab-separated fields
+//
+//     id  index  query  [option ...]
+//
+// The options are s=N, i=N and d=N (Levenshtein budgets, 0 if omitted),
+// r=X (score radius, needs --matrix-search), k=N or mk=N (the N nearest by
+// Levenshtein distance or by matrix score), v=GENE and j=GENE. A request is
+// answered by one line per match and a final line with its latency,
+//
+//     id  m  junction  dist  v_gene  j_gene
+//     id  done  matches  latency_us
+//
+// or by the single line `id  error  message`. A client's requests may be
+// answered out of order. The line `stats` is answered by
+// `stats  requests  p50_us  p99_us  max_us`, and `shutdown` stops the server
+// once the requests already received are answered.
+
+using Clock = std::chrono::steady_clock;
+
+static const size_t READ_BUFFER_SIZE = 1 << 16;
+// Latency percentiles are taken over this many of the latest requests.
+static const size_t LATENCY_WINDOW = 1 << 20;
+
+// Calls onLine for each line read from fd until EOF or onLine returns false.
+template <typename OnLine>
+static void ReadLines(int fd, OnLine onLine) {
+    std::vector<char> buffer(READ_BUFFER_SIZE);
+    std::string pending;
+    for (;;) {
+        ssize_t n = ::read(fd, buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(buffer.data(), n);
+        size_t begin = 0;
+        for (size_t end; (end = pending.find('\n', begin)) != std::string::npos; begin = end + 1) {
+            size_t length = end - begin;
+            if (length > 0 && pending[end - 1] == '\r') --length;
+            if (!onLine(std::string_view(pending).substr(begin, length))) return;
+        }
+        pending.erase(0, begin);
+    }
+    if (!pending.empty()) {
+        onLine(std::string_view(pending));
+    }
+}
+
+static bool WriteAll(int fd, std::string_view text) {
+    while (!text.empty()) {
+        ssize_t n = ::write(fd, text.data(), text.size());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        text.remove_prefix(n);
+    }
+    return true;
+}
+
+static std::vector<std::string_view> SplitTabs(std::string_view line) {
+    std::vector<std::string_view> fields;
+    size_t begin = 0;
+    for (size_t end; (end = line.find('\t', begin)) != std::string_view::npos; begin = end + 1) {
+        fields.push_back(line.substr(begin, end - begin));
+    }
+    fields.push_back(line.substr(begin));
+    return fields;
+}
+
+template <typename Integer>
+static bool ParseNumber(std::string_view text, Integer& value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+
+static bool ParseNumber(std::string_view text, float& value) {
+    std::string copy(text);
+    char* end = nullptr;
+    value = std::strtof(copy.c_str(), &end);
+    return !copy.empty() && end == copy.c_str() + copy.size();
+}
+
+// Nearest-rank percentile of sorted values.
+static uint64_t Percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+static sockaddr_un SocketAddress(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+}
+
+static int ListenUnixSocket(const std::string& path) {
+    sockaddr_un address = SocketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Unable to create socket: ") + std::strerror(errno));
+    }
+    // A socket file left behind by a previous server would make bind fail.
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+        std::string reason = std::strerror(errno);
+        ::close(fd);
+        throw std::runtime_error("Unable to listen on " + path + ": " + reason);
+    }
+    return fd;
+}
+
+static int ConnectUnixSocket(const std::string& path) {
+    sockaddr_un address = SocketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        std::string reason = std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("Unable to connect to " + path + ": " + reason);
+    }
+    return fd;
+}
+
+// Splits name=path; a bare path is named after its file stem.
+static std::pair<std::string, std::string> SplitNamedPath(const std::string& entry) {
+    size_t separator = entry.find('=');
+    if (separator == std::string::npos) {
+        return { fs::path(entry).stem().string(), entry };
+    }
+    return { entry.substr(0, separator), entry.substr(separator + 1) };
+}
+
+namespace {
+
+// A client. For stdin/stdout, requests and responses use different
+// descriptors, which the connection does not own.
+class Connection {
+public:
+    Connection(int in, int out, bool owned) : in_(in), out_(out), owned_(owned) {}
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    ~Connection() {
+        if (owned_) ::close(in_);
+    }
+
+    int In() const { return in_; }
+
+    // Whole responses are written under the lock so that they never
+    // interleave. A client that went away is ignored from then on.
+    void Write(std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!broken_ && !WriteAll(out_, text)) {
+            broken_ = true;
+        }
+    }
+
+    // Wakes a reader blocked on this connection.
+    void Shutdown() {
+        if (owned_) ::shutdown(in_, SHUT_RDWR);
+    }
+
+private:
+    int in_;
+    int out_;
+    bool owned_;
+    std::mutex mutex_;
+    bool broken_ = false;
+};
+
+enum class SearchKind { Levenshtein, Matrix, Nearest, NearestWithMatrix };
+
+struct SearchParams {
+    SearchKind kind = SearchKind::Levenshtein;
+    int maxSubstitution = 0;
+    int maxInsertion = 0;
+    int maxDeletion = 0;
+    float costRadius = 0;
+    size_t topK = 0;
+    std::string vGene;
+    std::string jGene;
+
+    bool operator==(const SearchParams& other) const {
+        return kind == other.kind && maxSubstitution == other.maxSubstitution
+               && maxInsertion == other.maxInsertion && maxDeletion == other.maxDeletion
+               && costRadius == other.costRadius && topK == other.topK
+               && vGene == other.vGene && jGene == other.jGene;
+    }
+};
+
+struct Request {
+    std::shared_ptr<Connection> connection;
+    std::string id;
+    std::string index;
+    std::string query;
+    SearchParams params;
+    Clock::time_point received;
+};
+
+// Connection threads parse requests into one queue; a dispatcher thread
+// takes whatever has queued up (waiting up to the batch window for more)
+// and searches the requests sharing an index and parameters as one batch.
+// While a batch runs, the next one queues up, so batches grow with the load.
+class Server {
+public:
+    explicit Server(const ServeConfig& config);
+
+    void ServeStdio();
+
+    void ServeSocket(const std::string& path);
+
+    void PrintStats() const;
+
+private:
+    std::unordered_map<std::string, Trie> tries_;
+    bool hasMatrix_;
+    size_t maxBatch_;
+    std::chrono::microseconds window_;
+    BoundedQueue<Request> requests_;
+
+    std::atomic<bool> stopping_{ false };
+    int listenFd_ = -1;
+
+    mutable std::mutex latencyMutex_;
+    std::vector<uint64_t> latencies_;
+    uint64_t served_ = 0;
+
+    void ReadRequests(const std::shared_ptr<Connection>& connection);
+
+    bool ParseRequest(std::string_view line, Request& request, std::string& error) const;
+
+    void Dispatch();
+
+    void SearchGroup(const std::vector<Request*>& group);
+
+    void Respond(const Request& request, std::string& response, size_t matchCount);
+
+    void Stop();
+
+    // Over the last LATENCY_WINDOW requests, in microseconds.
+    struct LatencySummary {
+        uint64_t served = 0;
+        uint64_t p50 = 0;
+        uint64_t p99 = 0;
+        uint64_t max = 0;
+    };
+
+    LatencySummary Summarize() const;
+
+    std::string StatsLine() const;
+};
+
+Server::Server(const ServeConfig& config)
+        : hasMatrix_(!config.matrixPath.empty()),
+          maxBatch_(std::max<size_t>(config.maxBatch, 1)),
+          window_(std::max(config.batchWindowUs, 0)),
+          requests_(4 * maxBatch_) {
+    // One pool for all tries: the dispatcher searches one batch at a time.
+    auto pool = std::make_shared<ThreadPool>();
+    auto add = [&](const std::string& entry, bool isIndex) {
+        auto [name, path] = SplitNamedPath(entry);
+        Trie trie;
+        if (isIndex) {
+            if (!trie.LoadIndex(path)) {
+                throw std::runtime_error("Unable to load index " + path);
+            }
+        } else {
+            trie = Trie(path, pool);
+        }
+        trie.SetThreadPool(pool);
+        trie.SetDeletionScore(config.deletionScore);
+        if (hasMatrix_) {
+            trie.LoadSubstitutionMatrix(config.matrixPath);
+        }
+        trie.SetResultCacheSize(config.resultCacheSize);
+        if (!tries_.emplace(name, std::move(trie)).second) {
+            throw std::runtime_error("Index name used twice: " + name);
+        }
+        std::cerr << "Serving " << path << " as " << name << std::endl;
+    };
+    for (const auto& entry : config.indexPaths) add(entry, true);
+    for (const auto& entry : config.triePaths) add(entry, false);
+}
+
+void Server::ServeStdio() {
+    std::thread dispatcher(&Server::Dispatch, this);
+    ReadRequests(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false));
+    requests_.Close();
+    dispatcher.join();
+}
+
+void Server::ServeSocket(const std::string& path) {
+    listenFd_ = ListenUnixSocket(path);
+    std::cerr << "Listening on " << path << std::endl;
+
+    struct Client {
+        std::shared_ptr<Connection> connection;
+        std::shared_ptr<std::atomic<bool>> done;
+        std::thread reader;
+    };
+    std::list<Client> clients;
+
+    std::thread dispatcher(&Server::Dispatch, this);
+    while (!stopping_) {
+        int fd = ::accept(listenFd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!stopping_) std::cerr << "Error: accept failed: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        for (auto it = clients.begin(); it != clients.end();) {
+            if (it->done->load()) {
+                it->reader.join();
+                it = clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto connection = std::make_shared<Connection>(fd, fd, true);
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        std::thread reader([this, connection, done] {
+            ReadRequests(connection);
+            done->store(true);
+        });
+        clients.push_back({ std::move(connection), std::move(done), std::move(reader) });
+    }
+
+    requests_.Close();
+    dispatcher.join();
+    for (Client& client : clients) {
+        client.connection->Shutdown();
+        client.reader.join();
+    }
+    ::close(listenFd_);
+    ::unlink(path.c_str());
+}
+
+void Server::ReadRequests(const std::shared_ptr<Connection>& connection) {
+    ReadLines(connection->In(), [&](std::string_view line) {
+        if (line.empty()) return true;
+        if (line == "stats") {
+            connection->Write(StatsLine());
+            return true;
+        }
+        if (line == "shutdown") {
+            Stop();
+            return false;
+        }
+        Request request;
+        request.received = Clock::now();
+        std::string error;
+        if (!ParseRequest(line, request, error)) {
+            connection->Write(request.id + "\terror\t" + error + "\n");
+            return true;
+        }
+        request.connection = connection;
+        return requests_.Push(std::move(request));
+    });
+}
+
+bool Server::ParseRequest(std::string_view line, Request& request, std::string& error) const {
+    std::vector<std::string_view> fields = SplitTabs(line);
+    request.id = fields[0];
+    if (fields.size() < 3 || fields[2].empty()) {
+        error = "expected id, index and query";
+        return false;
+    }
+    request.index = fields[1];
+    request.query = fields[2];
+    if (tries_.find(request.index) == tries_.end()) {
+        error = "unknown index " + request.index;
+        return false;
+    }
+
+    SearchParams& params = request.params;
+    int modes = 0;
+    bool edits = false;
+    for (size_t f = 3; f < fields.size(); ++f) {
+        std::string_view option = fields[f];
+        size_t separator = option.find('=');
+        std::string_view key = option.substr(0, separator);
+        std::string_view value = separator == std::string_view::npos ? std::string_view() : option.substr(separator + 1);
+        bool valid = separator != std::string_view::npos;
+        if (key == "s" || key == "i" || key == "d") {
+            int& budget = key == "s" ? params.maxSubstitution : key == "i" ? params.maxInsertion : params.maxDeletion;
+            valid = valid && ParseNumber(value, budget) && budget >= 0;
+            modes += edits ? 0 : 1;
+            edits = true;
+        } else if (key == "r") {
+            valid = valid && ParseNumber(value, params.costRadius) && params.costRadius >= 0;
+            params.kind = SearchKind::Matrix;
+            ++modes;
+        } else if (key == "k" || key == "mk") {
+            valid = valid && ParseNumber(value, params.topK) && params.topK > 0;
+            params.kind = key == "k" ? SearchKind::Nearest : SearchKind::NearestWithMatrix;
+            ++modes;
+        } else if (key == "v") {
+            params.vGene = value;
+        } else if (key == "j") {
+            params.jGene = value;
+        } else {
+            valid = false;
+        }
+        if (!valid) {
+            error = "invalid option " + std::string(option);
+            return false;
+        }
+    }
+    if (modes > 1) {
+        error = "s/i/d, r, k and mk exclude each other";
+        return false;
+    }
+    if ((params.kind == SearchKind::Matrix || params.kind == SearchKind::NearestWithMatrix) && !hasMatrix_) {
+        error = "no substitution matrix loaded";
+        return false;
+    }
+    return true;
+}
+
+void Server::Dispatch() {
+    Request first;
+    while (requests_.Pop(first)) {
+        std::vector<Request> batch;
+        batch.push_back(std::move(first));
+        Clock::time_point deadline = Clock::now() + window_;
+        Request next;
+        while (batch.size() < maxBatch_ && requests_.PopUntil(next, deadline)) {
+            batch.push_back(std::move(next));
+        }
+
+        std::vector<bool> grouped(batch.size(), false);
+        std::vector<Request*> group;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (grouped[i]) continue;
+            group.clear();
+            for (size_t j = i; j < batch.size(); ++j) {
+                if (!grouped[j] && batch[j].index == batch[i].index && batch[j].params == batch[i].params) {
+                    grouped[j] = true;
+                    group.push_back(&batch[j]);
+                }
+            }
+            SearchGroup(group);
+        }
+    }
+}
+
+static void AppendMatch(std::string& response, const std::string& id, std::string_view junction, double distance,
+                        std::string_view vGene, std::string_view jGene) {
+    char number[32];
+    std::snprintf(number, sizeof(number), "%g", distance);
+    response += id;
+    response += "\tm\t";
+    response += junction;
+    response += '\t';
+    response += number;
+    response += '\t';
+    response += vGene;
+    response += '\t';
+    response += jGene;
+    response += '\n';
+}
+
+void Server::SearchGroup(const std::vector<Request*>& group) {
+    const SearchParams& params = group.front()->params;
+    Trie& trie = tries_.at(group.front()->index);
+    std::optional<std::string> vGene, jGene;
+    if (!params.vGene.empty()) vGene = params.vGene;
+    if (!params.jGene.empty()) jGene = params.jGene;
+
+    std::vector<std::string> queries;
+    queries.reserve(group.size());
+    for (const Request* request : group) {
+        queries.push_back(request->query);
+    }
+
+    try {
+        if (params.kind == SearchKind::Levenshtein || params.kind == SearchKind::Matrix) {
+            Trie::BatchMatches matches = params.kind == SearchKind::Levenshtein
+                    ? trie.SearchForAllIndexed(queries, params.maxSubstitution, params.maxInsertion,
+                                               params.maxDeletion, vGene, jGene)
+                    : trie.SearchForAllWithMatrixIndexed(queries, params.costRadius, vGene, jGene);
+            for (size_t q = 0; q < group.size(); ++q) {
+                auto [begin, end] = matches.ForQuery(q);
+                std::string response;
+                for (const Trie::RecordMatch* match = begin; match != end; ++match) {
+                    AppendMatch(response, group[q]->id, trie.MatchJunction(*match), match->distance,
+                                trie.MatchVGene(*match), trie.MatchJGene(*match));
+                }
+                Respond(*group[q], response, end - begin);
+            }
+        } else {
+            auto results = params.kind == SearchKind::Nearest
+                    ? trie.SearchNearestForAll(queries, params.topK, vGene, jGene)
+                    : trie.SearchNearestForAllWithMatrix(queries, params.topK, vGene, jGene);
+            for (const Request* request : group) {
+                const std::vector<AIRREntity>& matches = results[request->query];
+                std::string response;
+                for (const AIRREntity& match : matches) {
+                    AppendMatch(response, request->id, match.junctionAA, match.distance, match.vGene, match.jGene);
+                }
+                Respond(*request, response, matches.size());
+            }
+        }
+    } catch (const std::exception& ex) {
+        for (const Request* request : group) {
+            request->connection->Write(request->id + "\terror\t" + ex.what() + "\n");
+        }
+    }
+}
+
+void Server::Respond(const Request& request, std::string& response, size_t matchCount) {
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - request.received).count();
+    response += request.id;
+    response += "\tdone\t";
+    response += std::to_string(matchCount);
+    response += '\t';
+    response += std::to_string(latency);
+    response += '\n';
+    request.connection->Write(response);
+
+    std::lock_guard<std::mutex> lock(latencyMutex_);
+    if (latencies_.size() < LATENCY_WINDOW) {
+        latencies_.push_back(latency);
+    } else {
+        latencies_[served_ % LATENCY_WINDOW] = latency;
+    }
+    ++served_;
+}
+
+void Server::Stop() {
+    stopping_ = true;
+    if (listenFd_ >= 0) {
+        ::shutdown(listenFd_, SHUT_RDWR);
+    }
+}
+
+Server::LatencySummary Server::Summarize() const {
+    std::vector<uint64_t> sorted;
+    LatencySummary summary;
+    {
+        std::lock_guard<std::mutex> lock(latencyMutex_);
+        sorted = latencies_;
+        summary.served = served_;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    summary.p50 = Percentile(sorted, 0.5);
+    summary.p99 = Percentile(sorted, 0.99);
+    summary.max = sorted.empty() ? 0 : sorted.back();
+    return summary;
+}
+
+std::string Server::StatsLine() const {
+    LatencySummary summary = Summarize();
+    return "stats\t" + std::to_string(summary.served) + '\t' + std::to_string(summary.p50) + '\t'
+           + std::to_string(summary.p99) + '\t' + std::to_string(summary.max) + '\n';
+}
+
+void Server::PrintStats() const {
+    LatencySummary summary = Summarize();
+    std::cerr << "Served " << summary.served << " requests; latency p50 " << summary.p50 << " us, p99 "
+              << summary.p99 << " us, max " << summary.max << " us" << std::endl;
+    for (const auto& [name, trie] : tries_) {
+        Trie::ResultCacheStats cache = trie.GetResultCacheStats();
+        if (cache.hits + cache.misses > 0) {
+            std::cerr << name << ": result cache hits " << cache.hits << ", misses " << cache.misses << std::endl;
+        }
+    }
+}
+
+} // namespace
+
+void RunServer(const ServeConfig& config) {
+    // Writing to a client that went away must fail, not kill the server.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Responses go to stdout directly; the messages the Trie prints while
+    // loading the indexes and matrix must not end up among them.
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+    try {
+        Server server(config);
+        if (config.socketPath.empty()) {
+            server.ServeStdio();
+        } else {
+            server.ServeSocket(config.socketPath);
+        }
+        server.PrintStats();
+    } catch (...) {
+        std::cout.rdbuf(stdoutBuffer);
+        throw;
+    }
+    std::cout.rdbuf(stdoutBuffer);
+}
+
+static std::vector<std::string> ReadQueries(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Unable to read " + path);
+    }
+    std::vector<std::string> queries;
+    std::string line;
+    std::getline(file, line);
+    while (std::getline(file, line)) {
+        std::string field = line.substr(0, line.find('\t'));
+        if (!field.empty()) queries.push_back(std::move(field));
+    }
+    return queries;
+}
+
+void RunLoadTest(const LoadTestConfig& config) {
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::string> queries = ReadQueries(config.inputQueries);
+    if (queries.empty()) {
+        throw std::runtime_error("No queries in " + config.inputQueries);
+    }
+    std::string options;
+    for (const auto& option : config.options) {
+        options += '\t';
+        options += option;
+    }
+
+    struct ClientResult {
+        std::vector<uint64_t> latencies;
+        std::vector<uint64_t> serverLatencies;
+        size_t errors = 0;
+    };
+    size_t clientCount = std::max<size_t>(config.clients, 1);
+    size_t pipeline = std::max<size_t>(config.pipeline, 1);
+    std::vector<ClientResult> results(clientCount);
+    std::vector<int> fds;
+    for (size_t c = 0; c < clientCount; ++c) {
+        fds.push_back(ConnectUnixSocket(config.socketPath));
+    }
+
+    // Client c sends requests c, c + clientCount, ... with ids counting from 0
+    // and keeps `pipeline` of them in flight.
+    auto runClient = [&](size_t c) {
+        int fd = fds[c];
+        ClientResult& result = results[c];
+        size_t count = config.requests / clientCount + (c < config.requests % clientCount ? 1 : 0);
+        std::vector<Clock::time_point> sent(count);
+        size_t next = 0, answered = 0;
+        auto send = [&]() {
+            const std::string& query = queries[(c + next * clientCount) % queries.size()];
+            std::string line = std::to_string(next) + '\t' + config.index + '\t' + query + options + '\n';
+            sent[next++] = Clock::now();
+            return WriteAll(fd, line);
+        };
+
+        bool ok = true;
+        while (ok && next < std::min(pipeline, count)) ok = send();
+        if (ok && count > 0) {
+            ReadLines(fd, [&](std::string_view line) {
+                std::vector<std::string_view> fields = SplitTabs(line);
+                size_t id;
+                if (fields.size() < 3 || !ParseNumber(fields[0], id) || id >= next) return true;
+                if (fields[1] == "done") {
+                    result.latencies.push_back(
+                            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - sent[id]).count());
+                    uint64_t serverLatency;
+                    if (fields.size() > 3 && ParseNumber(fields[3], serverLatency)) {
+                        result.serverLatencies.push_back(serverLatency);
+                    }
+                } else if (fields[1] == "error") {
+                    if (result.errors++ == 0) {
+                        std::cerr << "Error from server: " << fields[2] << std::endl;
+                    }
+                } else {
+                    return true;
+                }
+                ++answered;
+                if (next < count && !send()) return false;
+                return answered < count;
+            });
+        }
+        ::close(fd);
+    };
+
+    auto start = Clock::now();
+    std::vector<std::thread> threads;
+    for (size_t c = 0; c < clientCount; ++c) {
+        threads.emplace_back(runClient, c);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+
+    ClientResult total;
+    for (const ClientResult& result : results) {
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+        total.serverLatencies.insert(total.serverLatencies.end(), result.serverLatencies.begin(),
+                                     result.serverLatencies.end());
+        total.errors += result.errors;
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    std::sort(total.serverLatencies.begin(), total.serverLatencies.end());
+
+    size_t answered = total.latencies.size() + total.errors;
+    std::cout << "Requests: " << answered << " of " << config.requests << " answered (" << total.errors
+              << " errors) by " << clientCount << " clients in " << elapsed.count() << " ms, "
+              << answered / (elapsed.count() / 1000) << " requests/s" << std::endl;
+    std::cout << "Latency (us): p50 " << Percentile(total.latencies, 0.5)
+              << ", p90 " << Percentile(total.latencies, 0.9)
+              << ", p99 " << Percentile(total.latencies, 0.99)
+              << ", max " << (total.latencies.empty() ? 0 : total.latencies.back()) << std::endl;
+    std::cout << "Server latency (us): p50 " << Percentile(total.serverLatencies, 0.5)
+              << ", p99 " << Percentile(total.serverLatencies, 0.99) << std::endl;
+}
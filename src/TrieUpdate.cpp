@@ -0,0 +1,393 @@
+#include "Trie.h"
+
+#include <algorithm>
+
+// Incremental updates. Node blocks, terminal ranges and record ranges cannot
+// grow in place once something follows them, so a growing one is copied to
+// the end of its column and the old copy is left behind as garbage. Erased
+// records are shifted out of their clonotype's range; a clonotype that loses
+// its last record is dropped from its node and its id retired (a
+// tombstone). Gene masks and length ranges are only ever widened, which
+// keeps them valid as bounds; the record counts along the path are kept
+// exact. Compact() rebuilds from the live records.
+//
+// Slots below the frozen counts may be seen by a snapshot and are never
+// written: the path to a changed node is copied from the root down, and a
+// frozen terminal range, record range or clonotype is copied before it
+// changes. Everything else is appended, which the snapshot does not see.
+
+// Only letters 'A'..'Z' take part in the trie path, as in BuildTrie.
+static std::string TrieKey(std::string_view junction) {
+    std::string key;
+    std::copy_if(junction.begin(), junction.end(), std::back_inserter(key),
+                 [](char c) { return c >= 'A' && c <= 'Z'; });
+    return key;
+}
+
+static uint32_t InternGene(StringColumn& names, std::string_view name) {
+    for (size_t id = 0; id < names.size(); ++id) {
+        if (names[id] == name) return id;
+    }
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+uint32_t Trie::Insert(const AIRREntity& entity) {
+    uint32_t row = InsertRecord(entity);
+    CompactIfSparse();
+    return row;
+}
+
+void Trie::Insert(const std::vector<AIRREntity>& entities) {
+    for (const auto& entity : entities) {
+        InsertRecord(entity);
+    }
+    CompactIfSparse();
+}
+
+bool Trie::Erase(const AIRREntity& entity) {
+    bool erased = EraseRecord(entity);
+    CompactIfSparse();
+    return erased;
+}
+
+size_t Trie::Erase(const std::vector<AIRREntity>& entities) {
+    size_t erased = 0;
+    for (const auto& entity : entities) {
+        erased += EraseRecord(entity);
+    }
+    CompactIfSparse();
+    return erased;
+}
+
+uint32_t Trie::InsertRecord(const AIRREntity& entity) {
+    uint32_t vGene = InternGene(vGeneNames_, entity.vGene);
+    uint32_t jGene = InternGene(jGeneNames_, entity.jGene);
+    std::string key = TrieKey(entity.junctionAA);
+    const uint32_t length = key.size();
+
+    auto widen = [&](uint32_t nodeIndex) {
+        GeneMasks& masks = geneMasks_.Mutable(nodeIndex);
+        masks.vGenes |= uint64_t{1} << (vGene % 64);
+        masks.jGenes |= uint64_t{1} << (jGene % 64);
+        LengthRange& lengths = lengthRanges_.Mutable(nodeIndex);
+        lengths.minLength = std::min(lengths.minLength, length);
+        lengths.maxLength = std::max(lengths.maxLength, length);
+        ++subtreeRecords_.Mutable(nodeIndex);
+    };
+    uint32_t nodeIndex = WritableRoot();
+    widen(nodeIndex);
+    for (char c : key) {
+        nodeIndex = WritableChild(nodeIndex, c - 'A');
+        widen(nodeIndex);
+    }
+    maxDepth_ = std::max<size_t>(maxDepth_, length);
+
+    TrieNode node = nodes_[nodeIndex];
+    uint32_t position = node.indicesBegin;
+    while (position < node.indicesEnd && clonotypes_[terminalIndices_[position]] != entity.junctionAA) {
+        ++position;
+    }
+    uint32_t clonotype;
+    if (position == node.indicesEnd) {
+        clonotype = clonotypes_.size();
+        clonotypes_.push_back(entity.junctionAA);
+        uint32_t recordEnd = records_.size();
+        recordRanges_.push_back({ recordEnd, recordEnd });
+        if (node.indicesEnd != terminalIndices_.size()) {
+            RelocateTerminals(node);
+        }
+        terminalIndices_.push_back(clonotype);
+        node.indicesEnd = terminalIndices_.size();
+        nodes_.Mutable(nodeIndex) = node;
+    } else {
+        clonotype = terminalIndices_[position];
+        if (clonotype < frozenClonotypes_) {
+            if (node.indicesBegin < frozenTerminals_) {
+                position += terminalIndices_.size() - node.indicesBegin;
+                RelocateTerminals(node);
+                nodes_.Mutable(nodeIndex) = node;
+            }
+            clonotype = RenewClonotype(clonotype, position);
+        }
+    }
+
+    // The new row is the highest, so appending keeps the records in row order.
+    RecordRange range = recordRanges_[clonotype];
+    if (range.end != records_.size()) {
+        uint32_t begin = records_.size();
+        for (uint32_t r = range.begin; r < range.end; ++r) {
+            CloneRecord moved = records_[r];
+            records_.push_back(moved);
+        }
+        garbage_ += range.end - range.begin;
+        range = { begin, static_cast<uint32_t>(records_.size()) };
+    }
+    uint32_t row = nextRow_++;
+    records_.push_back({ vGene, jGene, row });
+    ++range.end;
+    recordRanges_.Mutable(clonotype) = range;
+
+    compacted_ = false;
+    InvalidateResults();
+    return row;
+}
+
+bool Trie::EraseRecord(const AIRREntity& entity) {
+    std::string key = TrieKey(entity.junctionAA);
+    uint32_t nodeIndex = FindNode(key);
+    std::optional<uint32_t> vGene = FindVGene(entity.vGene);
+    std::optional<uint32_t> jGene = FindJGene(entity.jGene);
+    if (nodeIndex == UINT32_MAX || !vGene || !jGene) return false;
+
+    TrieNode node = nodes_[nodeIndex];
+    uint32_t position = node.indicesBegin;
+    while (position < node.indicesEnd && clonotypes_[terminalIndices_[position]] != entity.junctionAA) {
+        ++position;
+    }
+    if (position == node.indicesEnd) return false;
+    uint32_t clonotype = terminalIndices_[position];
+
+    RecordRange range = recordRanges_[clonotype];
+    uint32_t record = range.begin;
+    while (record < range.end && (records_[record].vGene != *vGene || records_[record].jGene != *jGene)) {
+        ++record;
+    }
+    if (record == range.end) return false;
+
+    // Only now that something is removed, take the path over.
+    position -= node.indicesBegin;
+    nodeIndex = WritableRoot();
+    --subtreeRecords_.Mutable(nodeIndex);
+    for (char c : key) {
+        nodeIndex = WritableChild(nodeIndex, c - 'A');
+        --subtreeRecords_.Mutable(nodeIndex);
+    }
+    node = nodes_[nodeIndex];
+    if (node.indicesBegin < frozenTerminals_) {
+        RelocateTerminals(node);
+        nodes_.Mutable(nodeIndex) = node;
+    }
+    position += node.indicesBegin;
+    if (clonotype < frozenClonotypes_) {
+        clonotype = RenewClonotype(clonotype, position);
+    }
+
+    record -= range.begin;
+    range = recordRanges_[clonotype];
+    if (range.begin < frozenRecords_) {
+        uint32_t begin = records_.size();
+        for (uint32_t r = range.begin; r < range.end; ++r) {
+            CloneRecord moved = records_[r];
+            records_.push_back(moved);
+        }
+        garbage_ += range.end - range.begin;
+        range = { begin, static_cast<uint32_t>(records_.size()) };
+    }
+    record += range.begin;
+    for (uint32_t r = record + 1; r < range.end; ++r) {
+        CloneRecord next = records_[r];
+        records_.Mutable(r - 1) = next;
+    }
+    --range.end;
+    recordRanges_.Mutable(clonotype) = range;
+    ++garbage_;
+
+    if (range.begin == range.end) {
+        for (uint32_t k = position + 1; k < node.indicesEnd; ++k) {
+            int next = terminalIndices_[k];
+            terminalIndices_.Mutable(k - 1) = next;
+        }
+        --node.indicesEnd;
+        nodes_.Mutable(nodeIndex) = node;
+        // The terminal slot and the retired clonotype.
+        garbage_ += 2;
+    }
+
+    compacted_ = false;
+    InvalidateResults();
+    return true;
+}
+
+uint32_t Trie::FindNode(std::string_view key) const {
+    uint32_t nodeIndex = root_;
+    for (char c : key) {
+        const TrieNode& node = nodes_[nodeIndex];
+        uint32_t bit = 1u << (c - 'A');
+        if ((node.childMask & bit) == 0) return UINT32_MAX;
+        nodeIndex = node.firstChild + __builtin_popcount(node.childMask & (bit - 1));
+    }
+    return nodeIndex;
+}
+
+uint32_t Trie::WritableRoot() {
+    if (root_ >= frozenNodes_) return root_;
+    TrieNode node = nodes_[root_];
+    GeneMasks masks = geneMasks_[root_];
+    LengthRange lengths = lengthRanges_[root_];
+    uint32_t records = subtreeRecords_[root_];
+    root_ = nodes_.size();
+    nodes_.push_back(node);
+    geneMasks_.push_back(masks);
+    lengthRanges_.push_back(lengths);
+    subtreeRecords_.push_back(records);
+    ++garbage_;
+    return root_;
+}
+
+uint32_t Trie::WritableChild(uint32_t nodeIndex, int letterCode) {
+    TrieNode node = nodes_[nodeIndex];
+    uint32_t bit = 1u << letterCode;
+    uint32_t rank = __builtin_popcount(node.childMask & (bit - 1));
+    uint32_t childCount = __builtin_popcount(node.childMask);
+    bool present = (node.childMask & bit) != 0;
+    if (present && node.firstChild + rank >= frozenNodes_) return node.firstChild + rank;
+
+    auto addNode = [this](const TrieNode& child, const GeneMasks& masks, const LengthRange& lengths,
+                          uint32_t records) {
+        nodes_.push_back(child);
+        geneMasks_.push_back(masks);
+        lengthRanges_.push_back(lengths);
+        subtreeRecords_.push_back(records);
+    };
+    // A block already at the end of the pool takes a new last child in
+    // place; otherwise it is copied to the end, with the new child in its
+    // slot if there is one.
+    uint32_t firstChild;
+    if (!present && (childCount == 0 || (rank == childCount && node.firstChild + childCount == nodes_.size()))) {
+        firstChild = childCount == 0 ? nodes_.size() : node.firstChild;
+        addNode(TrieNode{}, GeneMasks{}, LengthRange{}, 0);
+    } else {
+        firstChild = nodes_.size();
+        for (uint32_t i = 0; i <= childCount; ++i) {
+            if (!present && i == rank) {
+                addNode(TrieNode{}, GeneMasks{}, LengthRange{}, 0);
+            }
+            if (i < childCount) {
+                TrieNode child = nodes_[node.firstChild + i];
+                GeneMasks masks = geneMasks_[node.firstChild + i];
+                LengthRange lengths = lengthRanges_[node.firstChild + i];
+                uint32_t records = subtreeRecords_[node.firstChild + i];
+                addNode(child, masks, lengths, records);
+            }
+        }
+        garbage_ += childCount;
+    }
+
+    TrieNode& parent = nodes_.Mutable(nodeIndex);
+    parent.childMask |= bit;
+    parent.firstChild = firstChild;
+    return firstChild + rank;
+}
+
+void Trie::RelocateTerminals(TrieNode& node) {
+    uint32_t begin = terminalIndices_.size();
+    for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+        int moved = terminalIndices_[k];
+        terminalIndices_.push_back(moved);
+    }
+    garbage_ += node.indicesEnd - node.indicesBegin;
+    node.indicesBegin = begin;
+    node.indicesEnd = terminalIndices_.size();
+}
+
+uint32_t Trie::RenewClonotype(uint32_t clonotype, uint32_t position) {
+    uint32_t renewed = clonotypes_.size();
+    std::string junction(clonotypes_[clonotype]);
+    RecordRange range = recordRanges_[clonotype];
+    clonotypes_.push_back(junction);
+    recordRanges_.push_back(range);
+    terminalIndices_.Mutable(position) = renewed;
+    ++garbage_;
+    return renewed;
+}
+
+Trie Trie::Snapshot() {
+    Trie snapshot;
+    snapshot.useSubstitutionMatrix_ = useSubstitutionMatrix_;
+    snapshot.levenshteinKernel_ = levenshteinKernel_;
+    snapshot.maxQueryLength_ = maxQueryLength_;
+    snapshot.maxDepth_ = maxDepth_;
+    snapshot.deletionScore_ = deletionScore_;
+    snapshot.nextRow_ = nextRow_;
+    snapshot.compacted_ = compacted_;
+    snapshot.garbage_ = garbage_;
+    snapshot.root_ = root_;
+    snapshot.substitutionMatrix_ = substitutionMatrix_;
+    snapshot.costTable_ = costTable_;
+    // Created here so that searches on the snapshot never race to create it.
+    snapshot.threadPool_ = Pool();
+    // Same contents, so cached results stay valid for the snapshot; the
+    // next update of this trie moves it to a new generation.
+    snapshot.resultCache_ = resultCache_;
+    snapshot.resultGeneration_ = resultGeneration_;
+
+    snapshot.nodes_ = nodes_.Snapshot();
+    snapshot.terminalIndices_ = terminalIndices_.Snapshot();
+    snapshot.clonotypes_ = clonotypes_.Snapshot();
+    snapshot.recordRanges_ = recordRanges_.Snapshot();
+    snapshot.records_ = records_.Snapshot();
+    snapshot.vGeneNames_ = vGeneNames_.Snapshot();
+    snapshot.jGeneNames_ = jGeneNames_.Snapshot();
+    snapshot.geneMasks_ = geneMasks_.Snapshot();
+    snapshot.lengthRanges_ = lengthRanges_.Snapshot();
+    snapshot.subtreeRecords_ = subtreeRecords_.Snapshot();
+
+    frozenNodes_ = nodes_.size();
+    frozenTerminals_ = terminalIndices_.size();
+    frozenRecords_ = records_.size();
+    frozenClonotypes_ = clonotypes_.size();
+    return snapshot;
+}
+
+void Trie::CompactIfSparse() {
+    size_t slots = nodes_.size() + terminalIndices_.size() + records_.size() + clonotypes_.size();
+    if (garbage_ * 2 > slots) {
+        Compact();
+    }
+}
+
+void Trie::Compact() {
+    if (compacted_) return;
+
+    // Live records in row order, so BuildTrie keeps rows tied the same way.
+    struct LiveRecord {
+        uint32_t row;
+        uint32_t clonotype;
+        uint32_t record;
+    };
+    // Superseded nodes and retired clonotypes may still hold stale ranges,
+    // so only what is reachable from the root counts.
+    std::vector<LiveRecord> live;
+    live.reserve(records_.size());
+    std::vector<uint32_t> stack{ root_ };
+    while (!stack.empty()) {
+        const TrieNode& node = nodes_[stack.back()];
+        stack.pop_back();
+        for (uint32_t k = node.indicesBegin; k < node.indicesEnd; ++k) {
+            uint32_t clonotype = terminalIndices_[k];
+            const RecordRange& range = recordRanges_[clonotype];
+            for (uint32_t r = range.begin; r < range.end; ++r) {
+                live.push_back({ records_[r].row, clonotype, r });
+            }
+        }
+        uint32_t childCount = __builtin_popcount(node.childMask);
+        for (uint32_t child = node.firstChild; child < node.firstChild + childCount; ++child) {
+            stack.push_back(child);
+        }
+    }
+    std::sort(live.begin(), live.end(), [](const LiveRecord& a, const LiveRecord& b) { return a.row < b.row; });
+
+    StringColumn sequences;
+    std::vector<uint32_t> vGeneIds, jGeneIds, rowIds;
+    vGeneIds.reserve(live.size());
+    jGeneIds.reserve(live.size());
+    rowIds.reserve(live.size());
+    for (const LiveRecord& entry : live) {
+        sequences.push_back(clonotypes_[entry.clonotype]);
+        vGeneIds.push_back(records_[entry.record].vGene);
+        jGeneIds.push_back(records_[entry.record].jGene);
+        rowIds.push_back(entry.row);
+    }
+    BuildTrie(sequences, Column<uint32_t>(std::move(vGeneIds)), Column<uint32_t>(std::move(jGeneIds)), &rowIds);
+}
@@ -1,5 +1,6 @@
 #include <CLI/CLI.hpp>
 #include "TrieInterface.h"
+#include "TrieServer.h"
 #include <iostream>
 
 int main(int argc, char** argv) {
@@ -10,24 +11,82 @@ int main(int argc, char** argv) {
 
     SearchConfig config;
 
-    app.add_option("-t,--trie", config.inputPath, "Path to AIRR file with sequences")->required();
+    auto* trieOpt = app.add_option("-t,--trie", config.inputPath, "Path to AIRR file with sequences");
+    app.add_option("--load-index", config.loadIndexPath, "Path to an index written by --save-index")->excludes(trieOpt);
+    app.add_option("--save-index", config.saveIndexPath, "Write the index built from --trie to this path")->needs(trieOpt);
     app.add_option("-o,--output", config.outputPath, "Path to output folder");
 
     auto* queryOpt = app.add_option("-q,--query", config.query, "Single query sequence");
     app.add_option("--v-gene", config.vGene, "V-gene to match")->needs(queryOpt);
     app.add_option("--j-gene", config.jGene, "J-gene to match")->needs(queryOpt);
-    app.add_option("--input-queries", config.inputQueries, "Path to AIRR file with batch query sequences");
+    auto* inputQueriesOpt = app.add_option("--input-queries", config.inputQueries, "Path to AIRR file with batch query sequences");
+    app.add_flag("--keep-order", config.keepOrder, "Write batch results in the order of the input queries")->needs(inputQueriesOpt);
+    app.add_flag("--join", config.useJoin, "Search a batch by joining a trie of the queries against the repertoire")->needs(inputQueriesOpt);
+    app.add_option("--stats", config.statsPath, "Write per-query search statistics to this TSV");
+    app.add_flag("--count", config.countOnly, "Write the number of matches of each query instead of the matches");
+    app.add_option("--self-join", config.selfJoinPath, "Write every pair of repertoire sequences within the limits to this binary edge list")
+            ->excludes(queryOpt)->excludes(inputQueriesOpt);
 
     app.add_option("-s,--sub", config.maxSubstitution, "Allowable number of substitutions");
     app.add_option("-i,--ins", config.maxInsertion, "Allowed number of inserts");
     app.add_option("-d,--del", config.maxDeletion, "Allowed number of deletions");
+    app.add_option("-k,--top-k", config.topK, "Return the k nearest sequences instead of a fixed radius")
+            ->check(CLI::PositiveNumber);
 
     auto* matrixOpt = app.add_option("-m,--matrix-search", config.matrixPath, "Path to substitution matrix file");
     app.add_option("-r,--score-radius", config.costRadius, "Score radius for matrix-based search")->needs(matrixOpt);
     app.add_option("--deletion-score", config.deletionScore, "Cost for deletion for matrix-based search")->needs(matrixOpt);
+    app.add_option("--result-cache", config.resultCacheSize, "Recent searches whose matches are kept for repeated queries; "
+                   "memory grows with their match counts (default 0: off)")
+            ->check(CLI::NonNegativeNumber);
+
+    ServeConfig serveConfig;
+    auto* serve = app.add_subcommand("serve", "Keep indexes loaded and answer line-delimited search requests");
+    auto* serveTrieOpt = serve->add_option("-t,--trie", serveConfig.triePaths, "AIRR file to serve, as name=path");
+    auto* serveIndexOpt = serve->add_option("--load-index", serveConfig.indexPaths, "Index to serve, as name=path");
+    serve->add_option("--socket", serveConfig.socketPath, "Unix socket to listen on instead of stdin/stdout");
+    serve->add_option("-m,--matrix-search", serveConfig.matrixPath, "Path to substitution matrix file");
+    serve->add_option("--deletion-score", serveConfig.deletionScore, "Cost for deletion for matrix-based search");
+    serve->add_option("--result-cache", serveConfig.resultCacheSize,
+                      "Recent searches whose matches are kept per index for repeated queries; "
+                      "memory grows with their match counts (default 0: off)")
+            ->check(CLI::NonNegativeNumber);
+    serve->add_option("--max-batch", serveConfig.maxBatch, "Most requests searched as one batch")
+            ->check(CLI::PositiveNumber);
+    serve->add_option("--batch-window-us", serveConfig.batchWindowUs,
+                      "Microseconds a batch waits for more requests after its first")->check(CLI::NonNegativeNumber);
+    serve->callback([&]() {
+        if (serveTrieOpt->count() == 0 && serveIndexOpt->count() == 0) {
+            throw CLI::ValidationError("serve needs at least one --trie or --load-index.");
+        }
+    });
+
+    LoadTestConfig loadTestConfig;
+    auto* loadTest = app.add_subcommand("load-test", "Measure the latency of a server listening on a Unix socket");
+    loadTest->add_option("--socket", loadTestConfig.socketPath, "Socket the server listens on")->required();
+    loadTest->add_option("--input-queries", loadTestConfig.inputQueries, "Path to AIRR file with the queries to send")
+            ->required();
+    loadTest->add_option("--index", loadTestConfig.index, "Name of the index to search")->required();
+    loadTest->add_option("--options", loadTestConfig.options, "Request options, e.g. s=1 i=1 d=1 or k=10");
+    loadTest->add_option("--clients", loadTestConfig.clients, "Number of concurrent connections")
+            ->check(CLI::PositiveNumber);
+    loadTest->add_option("--requests", loadTestConfig.requests, "Total number of requests");
+    loadTest->add_option("--pipeline", loadTestConfig.pipeline, "Requests each connection keeps in flight")
+            ->check(CLI::PositiveNumber);
+
+    app.require_subcommand(0, 1);
 
     app.callback([&]() {
-        if (config.query.empty() && config.inputQueries.empty()) {
+        if (serve->parsed() || loadTest->parsed()) {
+            return;
+        }
+
+        if (config.inputPath.empty() && config.loadIndexPath.empty()) {
+            throw CLI::ValidationError("One of --trie or --load-index must be specified.");
+        }
+
+        if (config.query.empty() && config.inputQueries.empty() && config.saveIndexPath.empty()
+            && config.selfJoinPath.empty()) {
             throw CLI::ValidationError("No query received");
         }
 
@@ -41,7 +100,28 @@ int main(int argc, char** argv) {
             throw CLI::ValidationError("Only one of Levenshtein or Score search must be specified.");
         }
 
-        if (!config.matrixPath.empty() && config.costRadius < 0) {
+        if (!config.selfJoinPath.empty() && (!config.matrixPath.empty() || config.maxSubstitution < 0
+                                             || config.maxInsertion < 0
+                                             || (config.maxDeletion >= 0 && config.maxDeletion != config.maxInsertion))) {
+            throw CLI::ValidationError("--self-join needs --sub and --ins; --del, if given, must equal --ins.");
+        }
+
+        if (!config.statsPath.empty() && ((config.query.empty() && config.inputQueries.empty())
+                                          || config.topK > 0 || config.useJoin)) {
+            throw CLI::ValidationError("--stats needs a radius search of --query or --input-queries without --top-k or --join.");
+        }
+
+        if (config.countOnly && ((config.query.empty() && config.inputQueries.empty())
+                                 || config.topK > 0 || config.useJoin || !config.statsPath.empty())) {
+            throw CLI::ValidationError("--count needs a radius search of --query or --input-queries without --top-k, --join or --stats.");
+        }
+
+        if (config.topK > 0 && (config.maxSubstitution >= 0 || config.maxInsertion >= 0
+                                || config.maxDeletion >= 0 || config.costRadius >= 0 || config.useJoin)) {
+            throw CLI::ValidationError("--top-k replaces --sub/--ins/--del, --score-radius and --join.");
+        }
+
+        if (!config.matrixPath.empty() && config.costRadius < 0 && config.topK == 0) {
             throw CLI::ValidationError("--score-radius must be specified with --matrix-search.");
         }
 
@@ -53,6 +133,15 @@ int main(int argc, char** argv) {
     CLI11_PARSE(app, argc, argv);
 
     try {
+        if (serve->parsed()) {
+            RunServer(serveConfig);
+            return 0;
+        }
+        if (loadTest->parsed()) {
+            RunLoadTest(loadTestConfig);
+            return 0;
+        }
+
         auto start_time = std::chrono::high_resolution_clock::now();
         RunSearch(config);
         auto end_time = std::chrono::high_resolution_clock::now();